@@ -0,0 +1,45 @@
+#include <QtCore>
+#include "base64.h"
+
+//throughput of Base64 against the QByteArray codec. Build with -DKPROXY_BENCH=ON
+namespace {
+    constexpr qint64 kBytesPerRun = 256LL * 1024 * 1024;
+
+    template<typename F>
+    double megabytesPerSecond(qsizetype size, F&& f) {
+        auto runs = qMax(1LL, kBytesPerRun / size);
+        QElapsedTimer timer;
+        timer.start();
+        qsizetype check = 0;
+        for (qint64 i = 0; i < runs; i++) {
+            check += f().size();
+        }
+        auto ns = qMax(1LL, timer.nsecsElapsed());
+        if (check == 0) return 0; //keeps the results in use
+        return double(size) * runs * 1000.0 / ns;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    QCoreApplication app(argc, argv);
+
+    printf("%10s %12s %12s %12s %12s\n", "bytes", "encode MB/s", "qt encode", "decode MB/s", "qt decode");
+    for (qsizetype size: {16, 256, 4096, 65536, 1024 * 1024}) {
+        QByteArray data(size, Qt::Uninitialized);
+        for (qsizetype i = 0; i < size; i++) {
+            data[i] = char(QRandomGenerator::global()->generate());
+        }
+        auto encoded = data.toBase64();
+        if (Base64::toBase64(data) != encoded || Base64::fromBase64(encoded) != data) {
+            fprintf(stderr, "Base64 differs from QByteArray at %lld bytes\n", qint64(size));
+            return 1;
+        }
+
+        auto encode = megabytesPerSecond(size, [&] {return Base64::toBase64(data);});
+        auto qtEncode = megabytesPerSecond(size, [&] {return data.toBase64();});
+        auto decode = megabytesPerSecond(size, [&] {return Base64::fromBase64(encoded);});
+        auto qtDecode = megabytesPerSecond(size, [&] {return QByteArray::fromBase64(encoded);});
+        printf("%10lld %12.0f %12.0f %12.0f %12.0f\n", qint64(size), encode, qtEncode, decode, qtDecode);
+    }
+    return 0;
+}
@@ -0,0 +1,275 @@
+#include "base64.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define KPROXY_BASE64_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+    constexpr char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    struct DecodeTable {
+        qint8 values[256];
+        constexpr DecodeTable() : values{} {
+            for (auto& v: values) v = -1;
+            for (int i = 0; i < 64; i++) values[quint8(kAlphabet[i])] = i;
+        }
+    };
+    constexpr DecodeTable kDecode;
+
+    using EncodeKernel = qsizetype (*)(const quint8* in, qsizetype size, char* out);
+    using DecodeKernel = qsizetype (*)(const char* in, qsizetype size, quint8* out);
+
+    //the kernels process whole blocks and return how many input bytes they consumed,
+    //the scalar code does the rest
+    qsizetype encodeNone(const quint8*, qsizetype, char*) {return 0;}
+    qsizetype decodeNone(const char*, qsizetype, quint8*) {return 0;}
+
+    void encodeScalar(const quint8* src, qsizetype size, char* out) {
+        qsizetype i = 0;
+        for (; i + 3 <= size; i += 3) {
+            quint32 v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+            *out++ = kAlphabet[(v >> 18) & 0x3f];
+            *out++ = kAlphabet[(v >> 12) & 0x3f];
+            *out++ = kAlphabet[(v >> 6) & 0x3f];
+            *out++ = kAlphabet[v & 0x3f];
+        }
+
+        auto rest = size - i;
+        if (rest) {
+            quint32 v = src[i] << 16;
+            if (rest == 2) v |= src[i + 1] << 8;
+            *out++ = kAlphabet[(v >> 18) & 0x3f];
+            *out++ = kAlphabet[(v >> 12) & 0x3f];
+            *out++ = rest == 2 ? kAlphabet[(v >> 6) & 0x3f] : '=';
+            *out++ = '=';
+        }
+    }
+
+    qsizetype decodeScalar(const quint8* src, qsizetype size, quint8* out) {
+        auto start = out;
+        for (qsizetype i = 0; i < size; i += 4) {
+            bool last = i + 4 == size;
+            qint32 a = kDecode.values[src[i]];
+            qint32 b = kDecode.values[src[i + 1]];
+            qint32 c = kDecode.values[src[i + 2]];
+            qint32 d = kDecode.values[src[i + 3]];
+            if (a < 0 || b < 0) return -1;
+
+            if (last && src[i + 2] == '=' && src[i + 3] == '=') {
+                *out++ = (a << 2) | (b >> 4);
+            } else if (last && src[i + 3] == '=') {
+                if (c < 0) return -1;
+                *out++ = (a << 2) | (b >> 4);
+                *out++ = (b << 4) | (c >> 2);
+            } else {
+                if (c < 0 || d < 0) return -1;
+                *out++ = (a << 2) | (b >> 4);
+                *out++ = (b << 4) | (c >> 2);
+                *out++ = (c << 6) | d;
+            }
+        }
+        return out - start;
+    }
+
+#ifdef KPROXY_BASE64_X86
+    //Wojciech Mula's vector base64 algorithms: 12 bytes <-> 16 characters per 128 bit lane
+
+    __attribute__((target("sse4.1")))
+    inline __m128i encodeLane(__m128i in) {
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        auto t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        auto t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        auto t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        auto t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        auto indices = _mm_or_si128(t1, t3);
+
+        //0..25 -> 'A', 26..51 -> 'a', 52..61 -> '0', 62 -> '+', 63 -> '/'
+        auto result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        auto less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+        auto shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                   '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                   '/' - 63, 'A', 0, 0);
+        return _mm_add_epi8(_mm_shuffle_epi8(shift, result), indices);
+    }
+
+    __attribute__((target("sse4.1")))
+    qsizetype encodeSse41(const quint8* in, qsizetype size, char* out) {
+        qsizetype i = 0;
+        for (; i + 16 <= size; i += 12) { //loads 16 bytes, uses 12
+            auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), encodeLane(block));
+            out += 16;
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2")))
+    qsizetype encodeAvx2(const quint8* in, qsizetype size, char* out) {
+        const auto shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                             10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+        const auto shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                            '/' - 63, 'A', 0, 0,
+                                            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                            '/' - 63, 'A', 0, 0);
+        qsizetype i = 0;
+        for (; i + 28 <= size; i += 24) { //two lanes of 12 bytes, the upper one loaded from i + 12
+            auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12));
+            auto block = _mm256_shuffle_epi8(_mm256_set_m128i(hi, lo), shuffle);
+
+            auto t0 = _mm256_and_si256(block, _mm256_set1_epi32(0x0fc0fc00));
+            auto t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+            auto t2 = _mm256_and_si256(block, _mm256_set1_epi32(0x003f03f0));
+            auto t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+            auto indices = _mm256_or_si256(t1, t3);
+
+            auto result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+            auto less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+            result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+            result = _mm256_add_epi8(_mm256_shuffle_epi8(shift, result), indices);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), result);
+            out += 32;
+        }
+        return i;
+    }
+
+    __attribute__((target("sse4.1")))
+    qsizetype decodeSse41(const char* in, qsizetype size, quint8* out) {
+        const auto shiftLut = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const auto maskLut = _mm_setr_epi8(char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                                           char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                                           char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54);
+        const auto bitLut = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80),
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+        const auto pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+        qsizetype i = 0;
+        //stores 16 bytes, uses 12. The last quad with the padding is left to the scalar code
+        for (; i + 24 <= size; i += 16) {
+            auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            auto high = _mm_and_si128(_mm_srli_epi32(block, 4), _mm_set1_epi8(0x0f));
+            auto low = _mm_and_si128(block, _mm_set1_epi8(0x0f));
+
+            auto mask = _mm_shuffle_epi8(maskLut, low);
+            auto bit = _mm_shuffle_epi8(bitLut, high);
+            auto invalid = _mm_cmpeq_epi8(_mm_and_si128(mask, bit), _mm_setzero_si128());
+            if (_mm_movemask_epi8(invalid)) break;
+
+            auto shift = _mm_shuffle_epi8(shiftLut, high);
+            shift = _mm_blendv_epi8(shift, _mm_set1_epi8(16), _mm_cmpeq_epi8(block, _mm_set1_epi8('/')));
+            auto values = _mm_add_epi8(block, shift);
+
+            auto merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+            auto bytes = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(bytes, pack));
+            out += 12;
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2")))
+    qsizetype decodeAvx2(const char* in, qsizetype size, quint8* out) {
+        const auto shiftLut = _mm256_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                               0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const auto maskLut = _mm256_setr_epi8(char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                                              char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                                              char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54,
+                                              char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                                              char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                                              char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54);
+        const auto bitLut = _mm256_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80),
+                                             0, 0, 0, 0, 0, 0, 0, 0,
+                                             0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80),
+                                             0, 0, 0, 0, 0, 0, 0, 0);
+        const auto pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                           2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+        const auto join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+        qsizetype i = 0;
+        //stores 32 bytes, uses 24. The last quad with the padding is left to the scalar code
+        for (; i + 44 <= size; i += 32) {
+            auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+            auto high = _mm256_and_si256(_mm256_srli_epi32(block, 4), _mm256_set1_epi8(0x0f));
+            auto low = _mm256_and_si256(block, _mm256_set1_epi8(0x0f));
+
+            auto mask = _mm256_shuffle_epi8(maskLut, low);
+            auto bit = _mm256_shuffle_epi8(bitLut, high);
+            auto invalid = _mm256_cmpeq_epi8(_mm256_and_si256(mask, bit), _mm256_setzero_si256());
+            if (_mm256_movemask_epi8(invalid)) break;
+
+            auto shift = _mm256_shuffle_epi8(shiftLut, high);
+            shift = _mm256_blendv_epi8(shift, _mm256_set1_epi8(16), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('/')));
+            auto values = _mm256_add_epi8(block, shift);
+
+            auto merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+            auto bytes = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+            bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(bytes, pack), join);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), bytes);
+            out += 24;
+        }
+        return i;
+    }
+#endif
+
+    struct Kernels {
+        EncodeKernel encode {encodeNone};
+        DecodeKernel decode {decodeNone};
+
+        Kernels() {
+#ifdef KPROXY_BASE64_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                encode = encodeAvx2;
+                decode = decodeAvx2;
+            } else if (__builtin_cpu_supports("sse4.1")) {
+                encode = encodeSse41;
+                decode = decodeSse41;
+            }
+#endif
+        }
+    };
+
+    const Kernels& kernels() {
+        static const Kernels instance;
+        return instance;
+    }
+}
+
+
+void Base64::encode(const char* in, qsizetype size, char* out) {
+    auto src = reinterpret_cast<const quint8*>(in);
+    auto done = kernels().encode(src, size, out);
+    encodeScalar(src + done, size - done, out + done / 3 * 4);
+}
+
+
+qsizetype Base64::decode(const char* in, qsizetype size, char* out) {
+    if (size % 4) return -1;
+
+    auto dst = reinterpret_cast<quint8*>(out);
+    auto done = kernels().decode(in, size, dst);
+    auto rest = decodeScalar(reinterpret_cast<const quint8*>(in) + done, size - done, dst + done / 4 * 3);
+    return rest < 0 ? -1 : done / 4 * 3 + rest;
+}
+
+
+QByteArray Base64::toBase64(QByteArrayView data) {
+    QByteArray result(encodedSize(data.size()), Qt::Uninitialized);
+    encode(data.data(), data.size(), result.data());
+    return result;
+}
+
+
+QByteArray Base64::fromBase64(QByteArrayView data) {
+    QByteArray result(decodedCapacity(data.size()), Qt::Uninitialized);
+    auto size = decode(data.data(), data.size(), result.data());
+    if (size < 0) {
+        return QByteArray::fromBase64(data.toByteArray());
+    }
+    result.truncate(size);
+    return result;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <QtCore>
+
+//base64 (RFC 4648, with padding) into caller provided memory. On x86 the
+//AVX2 or SSE4.1 kernels are selected at runtime, other targets use the scalar code
+class Base64 {
+public:
+    static constexpr qsizetype encodedSize(qsizetype size) {return (size + 2) / 3 * 4;}
+    static constexpr qsizetype decodedCapacity(qsizetype size) {return size / 4 * 3;}
+
+    //writes encodedSize(size) characters to out
+    static void encode(const char* in, qsizetype size, char* out);
+    //strict decoding of padded input. Returns the number of bytes written to out
+    //(at most decodedCapacity(size)) or -1 for invalid input
+    static qsizetype decode(const char* in, qsizetype size, char* out);
+
+    static QByteArray toBase64(QByteArrayView data);
+    //falls back to QByteArray::fromBase64 when the input is not strict base64
+    static QByteArray fromBase64(QByteArrayView data);
+};
@@ -0,0 +1,55 @@
+#include "batch_controller.h"
+
+BatchController::BatchController(qint32 minRecords, qint32 maxRecords, qint32 maxInFlight, qint32 step,
+                                 qint64 latencyTargetMs, QObject* parent) :
+    QObject(parent), mMinRecords{qBound(1, minRecords, maxRecords)}, mMaxRecords{maxRecords},
+    mMaxInFlight{qMax(1, maxInFlight)}, mStep{qMax(1, step)}, mLatencyTargetMs{latencyTargetMs}
+{
+    //slow start from the lower bounds
+    mBatchRecords = mMinRecords;
+}
+
+
+bool BatchController::canCut(qint64 latencyMs) const {
+    //replies of requests sent before the last cut do not cut again
+    return !mLastCut.isValid() || mLastCut.elapsed() >= latencyMs;
+}
+
+
+void BatchController::changed(qint32 batchRecords, qint32 inFlight) {
+    if (batchRecords == mBatchRecords && inFlight == mInFlight) return;
+
+    mBatchRecords = batchRecords;
+    mInFlight = inFlight;
+    emit operatingPointChanged(mBatchRecords, mInFlight, latencyMs());
+}
+
+
+void BatchController::recordSuccess(qint64 latencyMs) {
+    mLatencyMs = mLatencyMs > 0 ? mLatencyMs * 0.8 + latencyMs * 0.2 : latencyMs;
+
+    if (latencyMs > mLatencyTargetMs) {
+        mWindowSuccesses = 0;
+        if (canCut(latencyMs)) {
+            mLastCut.start();
+            changed(qMax(mMinRecords, mBatchRecords * 3 / 4), mInFlight);
+        }
+        return;
+    }
+
+    auto inFlight = mInFlight;
+    if (++mWindowSuccesses >= mInFlight) {
+        mWindowSuccesses = 0;
+        inFlight = qMin(mMaxInFlight, mInFlight + 1);
+    }
+    changed(qMin(mMaxRecords, mBatchRecords + mStep), inFlight);
+}
+
+
+void BatchController::recordFailure(qint64 latencyMs) {
+    mWindowSuccesses = 0;
+    if (!canCut(latencyMs)) return;
+
+    mLastCut.start();
+    changed(qMax(mMinRecords, mBatchRecords / 2), qMax(1, mInFlight / 2));
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <QtCore>
+
+//AIMD controller for the produce batch size and the number of requests in flight.
+//Every reply faster than latencyTargetMs adds batchStep records to the batch, and a full
+//window of such replies adds one request to the in-flight window. A slower reply cuts the
+//batch size by a quarter, a failure halves both. Cuts are applied at most once per round trip
+class BatchController : public QObject {
+    Q_OBJECT
+    qint32 mMinRecords;
+    qint32 mMaxRecords;
+    qint32 mMaxInFlight;
+    qint32 mStep;
+    qint64 mLatencyTargetMs;
+
+    qint32 mBatchRecords;
+    qint32 mInFlight {1};
+    qint32 mWindowSuccesses {0};
+    double mLatencyMs {0};          //moving average
+    QElapsedTimer mLastCut;
+
+    bool canCut(qint64 latencyMs) const;
+    void changed(qint32 batchRecords, qint32 inFlight);
+public:
+    BatchController(qint32 minRecords, qint32 maxRecords, qint32 maxInFlight, qint32 step,
+                    qint64 latencyTargetMs, QObject* parent = nullptr);
+
+    qint32 batchRecords() const {return mBatchRecords;}
+    qint32 inFlight() const {return mInFlight;}
+    qint64 latencyMs() const {return qint64(mLatencyMs);}
+
+    void recordSuccess(qint64 latencyMs);
+    void recordFailure(qint64 latencyMs);
+signals:
+    void operatingPointChanged(qint32 batchRecords, qint32 inFlight, qint64 latencyMs);
+};
@@ -0,0 +1,54 @@
+#include "circuit_breaker.h"
+
+CircuitBreaker::CircuitBreaker(qint32 failureThreshold, qint32 openMs, QObject* parent) :
+    QObject(parent), mFailureThreshold{failureThreshold}, mOpenMs{openMs}
+{
+    mOpenTimer.setSingleShot(true);
+    connect(&mOpenTimer, &QTimer::timeout, this, [this] {
+        setState(State::HalfOpen);
+        emit probeReady();
+    });
+}
+
+
+void CircuitBreaker::setState(State state) {
+    if (mState == state) return;
+    mState = state;
+    qDebug() << "circuit breaker" << state;
+    emit stateChanged(state);
+}
+
+
+bool CircuitBreaker::allowRequest() {
+    switch (mState) {
+    case State::Closed:
+        return true;
+    case State::Open:
+        return false;
+    case State::HalfOpen:
+        if (mProbeInFlight) return false;
+        mProbeInFlight = true;
+        return true;
+    }
+    return false;
+}
+
+
+void CircuitBreaker::recordSuccess() {
+    mFailures = 0;
+    mProbeInFlight = false;
+    mOpenTimer.stop();
+    setState(State::Closed);
+}
+
+
+void CircuitBreaker::recordFailure() {
+    mFailures++;
+    if (mFailureThreshold <= 0) return; //disabled
+
+    if (mState == State::HalfOpen || (mState == State::Closed && mFailures >= mFailureThreshold)) {
+        mProbeInFlight = false;
+        setState(State::Open);
+        mOpenTimer.start(mOpenMs);
+    }
+}
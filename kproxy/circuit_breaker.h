@@ -0,0 +1,32 @@
+#pragma once
+#include <QtCore>
+
+//Stops the traffic to a server which keeps failing. After failureThreshold consecutive
+//failures the breaker opens for openMs, then a single probe request is let through.
+//The probe closes the breaker on success or opens it again on failure
+class CircuitBreaker : public QObject {
+    Q_OBJECT
+public:
+    enum class State {Closed, Open, HalfOpen};
+    Q_ENUM(State)
+
+private:
+    State mState {State::Closed};
+    qint32 mFailureThreshold;
+    qint32 mOpenMs;
+    qint32 mFailures {0};
+    bool mProbeInFlight {false};
+    QTimer mOpenTimer;
+
+    void setState(State state);
+public:
+    CircuitBreaker(qint32 failureThreshold, qint32 openMs, QObject* parent = nullptr);
+
+    State state() const {return mState;}
+    bool allowRequest();
+    void recordSuccess();
+    void recordFailure();
+signals:
+    void stateChanged(CircuitBreaker::State state);
+    void probeReady();
+};
@@ -0,0 +1,27 @@
+#include "commit_policy.h"
+
+CommitPolicy::CommitPolicy(qint32 everyRecords, qint32 intervalMs, bool onShutdown, QObject* parent) :
+    QObject(parent), mEveryRecords{qMax(0, everyRecords)}, mIntervalMs{qMax(0, intervalMs)}, mOnShutdown{onShutdown}
+{
+    mInterval.setSingleShot(true);
+    connect(&mInterval, &QTimer::timeout, this, &CommitPolicy::commit);
+}
+
+
+void CommitPolicy::commit() {
+    mUncommitted = 0;
+    mInterval.stop();
+    emit commitDue();
+}
+
+
+void CommitPolicy::delivered(qint32 records) {
+    if (records <= 0) return;
+
+    mUncommitted += records;
+    if (mEveryRecords > 0 && mUncommitted >= mEveryRecords) {
+        commit();
+    } else if (mIntervalMs > 0 && !mInterval.isActive()) {
+        mInterval.start(mIntervalMs);
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <QtCore>
+
+//Decides when the consumer commits the offsets it delivered: after everyRecords records,
+//intervalMs after the first record delivered since the last commit, and on shutdown.
+//0 disables a trigger
+class CommitPolicy : public QObject {
+    Q_OBJECT
+    qint32 mEveryRecords;
+    qint32 mIntervalMs;
+    bool mOnShutdown;
+    qint32 mUncommitted {0};
+    QTimer mInterval;
+
+    void commit();
+public:
+    CommitPolicy(qint32 everyRecords, qint32 intervalMs, bool onShutdown, QObject* parent = nullptr);
+
+    bool commitOnShutdown() const {return mOnShutdown;}
+    qint32 uncommitted() const {return mUncommitted;}
+    void delivered(qint32 records);
+signals:
+    void commitDue();
+};
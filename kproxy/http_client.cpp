@@ -1,6 +1,7 @@
 #include "http_client.h"
 #include "kafka_messages.h"
 #include <qhttpheaders.h>
+#include <zlib.h>
 
 HttpClient::HttpClient(QString server, QString user, QString password, bool verbose) :
     mRest(&mNetworkManager), mServer{server}, mUser{user}, mPassword{password}, mVerbose{verbose}
@@ -13,6 +14,32 @@ HttpClient::HttpClient(QString server, QString user, QString password, bool verb
 }
 
 
+void HttpClient::setRequestCompression(bool gzip, qint32 minBytes) {
+    mGzipRequests = gzip;
+    mGzipMinBytes = minBytes;
+}
+
+
+QByteArray HttpClient::gzip(const QByteArray& data) {
+    z_stream stream{};
+    //15 + 16: the largest window with a gzip header and trailer instead of the zlib ones
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return {};
+    }
+
+    QByteArray result(deflateBound(&stream, data.size()), Qt::Uninitialized);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef*>(result.data());
+    stream.avail_out = result.size();
+
+    auto status = deflate(&stream, Z_FINISH);
+    result.truncate(stream.total_out);
+    deflateEnd(&stream);
+    return status == Z_STREAM_END ? result : QByteArray();
+}
+
+
 void HttpClient::onAuthenticationRequired(QNetworkReply *reply, QAuthenticator *authenticator) {
     authenticator->setUser(mUser);
     authenticator->setPassword(mPassword);
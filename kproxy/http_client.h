@@ -13,6 +13,47 @@ protected:
     QString mPassword;
     QElapsedTimer mTimer;
     bool mVerbose;
+    qint64 mLastRequestId {0};
+    QHash<qint64, qint64> mRequestStarted; //request id -> mTimer at send
+    bool mGzipRequests {false};
+    qint32 mGzipMinBytes {0};
+
+    qint64 nextRequestId() {
+        mRequestStarted.insert(++mLastRequestId, mTimer.elapsed());
+        return mLastRequestId;
+    }
+    //milliseconds since the request was created, called once when its reply arrives
+    qint64 takeLatency(qint64 requestId) {
+        auto started = mRequestStarted.take(requestId);
+        return mTimer.elapsed() - started;
+    }
+    static QByteArray gzip(const QByteArray& data);
+
+    //posts the body, gzip compressed on a worker thread when compression is enabled
+    template<typename Functor>
+    void postBody(QNetworkRequest request, const QByteArray& body, Functor callback) {
+        if (!mGzipRequests || body.size() < mGzipMinBytes) {
+            mRest.post(request, body, this, std::move(callback));
+            return;
+        }
+
+        auto promise = std::make_shared<QPromise<QByteArray>>();
+        auto future = promise->future();
+        QThreadPool::globalInstance()->start([promise, body] {
+            promise->start();
+            promise->addResult(gzip(body));
+            promise->finish();
+        });
+
+        future.then(this, [this, request, body, callback = std::move(callback)](QByteArray compressed) mutable {
+            if (compressed.isEmpty()) {
+                mRest.post(request, body, this, std::move(callback));
+            } else {
+                request.setRawHeader("Content-Encoding", "gzip");
+                mRest.post(request, compressed, this, std::move(callback));
+            }
+        });
+    }
 
     QString baseUrl(const QString& path) const;
     QNetworkRequest requestV2(const QString& path, const QString& type = "") const;
@@ -30,13 +71,19 @@ private slots:
     void onAuthenticationRequired(QNetworkReply *reply, QAuthenticator *authenticator);
 public:
     HttpClient(QString server, QString user, QString password, bool verbose);
+    //responses are decompressed by QNetworkAccessManager, which sends Accept-Encoding by itself
+    void setRequestCompression(bool gzip, qint32 minBytes);
 
     virtual void initialize(QString name) {}
-    virtual void sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& data) {}
+    //returns an id which is reported back with batchSent/batchFailed
+    virtual qint64 sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& data) {return -1;}
     virtual void sendJson(const QString& key, const QString& topic, const QJsonDocument& json) {}
 
 signals:
     void initialized(QString data);
     void messageSent();
     void failed(QString message);
+
+    void batchSent(qint64 requestId, qint64 latencyMs);
+    void batchFailed(qint64 requestId, QString message, qint64 latencyMs);
 };
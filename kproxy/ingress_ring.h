@@ -0,0 +1,75 @@
+#pragma once
+#include <QtCore>
+#include <atomic>
+#include <memory>
+
+//Bounded lock-free ring (Dmitry Vyukov's array queue). Any thread may push.
+//The owner thread drains it; a pushing thread may also pop, which is how the
+//oldest entry is dropped when the ring is full
+template<typename T>
+class IngressRing {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> mCells;
+    size_t mMask;
+    alignas(64) std::atomic<size_t> mPush {0};
+    alignas(64) std::atomic<size_t> mPop {0};
+
+public:
+    //the capacity is rounded up to a power of two
+    explicit IngressRing(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        mCells.reset(new Cell[size]);
+        mMask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            mCells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const {return mMask + 1;}
+
+    //value is moved from only when it was queued
+    bool tryPush(T&& value) {
+        auto pos = mPush.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &mCells[pos & mMask];
+            auto seq = cell->sequence.load(std::memory_order_acquire);
+            auto diff = qint64(seq) - qint64(pos);
+            if (diff == 0) {
+                if (mPush.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; //full
+            } else {
+                pos = mPush.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value) {
+        auto pos = mPop.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &mCells[pos & mMask];
+            auto seq = cell->sequence.load(std::memory_order_acquire);
+            auto diff = qint64(seq) - qint64(pos + 1);
+            if (diff == 0) {
+                if (mPop.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; //empty
+            } else {
+                pos = mPop.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->data);
+        cell->sequence.store(pos + mMask + 1, std::memory_order_release);
+        return true;
+    }
+};
@@ -3,6 +3,10 @@
 #include <qstatemachine.h>
 #include <QFinalState>
 
+namespace {
+    constexpr qint32 kShutdownCommitMs = 3000;
+}
+
 KafkaConsumer::KafkaConsumer(const QString& group, const QStringList& topics, bool verbose, const QString& mediaType)
 {
     createProxy(verbose, mediaType);
@@ -16,7 +20,6 @@ KafkaConsumer::KafkaConsumer(const QString& group, const QStringList& topics, bo
     auto init = new QState(work);        //request instanceID
     auto subscribe = new QState(work);   //subscribe to the topic
     auto read = new QState(work);        //read message
-    auto commitOffsets = new QState(work);
 
     connect(init,          &QState::entered, [this, group] {
         qDebug() << "initializing kafka consumer proxy";
@@ -24,15 +27,20 @@ KafkaConsumer::KafkaConsumer(const QString& group, const QStringList& topics, bo
     });
     connect(subscribe,     &QState::entered, [this, topics] {mProxy->subscribe(topics);});
     connect(read,          &QState::entered, [this] {mProxy->getRecords();});
-    connect(commitOffsets, &QState::entered, [this] {mProxy->commitAllOffsets();});
 
     connect(success,   &QState::entered, this, &KafkaConsumer::onSuccess);
 
     init->addTransition(mProxy.get(), &KafkaProxyV2::initialized, subscribe);
     subscribe->addTransition(mProxy.get(), &KafkaProxyV2::subscribed, read);
-    read->addTransition(mProxy.get(), &KafkaProxyV2::readingComplete, commitOffsets);
     read->addTransition(mProxy.get(), &KafkaProxyV2::readingError, init);
-    commitOffsets->addTransition(mProxy.get(), &KafkaProxyV2::offsetCommitted, read);
+    //every completed fetch starts the next one. The commits run beside the fetches,
+    //one at a time, and never hold up reading
+    read->addTransition(mProxy.get(), &KafkaProxyV2::readingComplete, read);
+
+    //the delivered offsets are committed explicitly when the commit policy says so
+    connect(mProxy.get(), &KafkaProxyV2::recordsFetched, this, [this](qint32 count) {mFetched = count;});
+    connect(mProxy.get(), &KafkaProxyV2::readingComplete, this, [this] {mCommitPolicy->delivered(mFetched);});
+    connect(mCommitPolicy.get(), &CommitPolicy::commitDue, this, [this] {mProxy->commitDeliveredOffsets();});
     
 
     //and report the receive message 
@@ -91,7 +99,25 @@ void KafkaConsumer::start() {
 
 void KafkaConsumer::stop() {
     mProxy->stopReading();
-    emit stopRequest();
+    if (!mCommitPolicy->commitOnShutdown() || !mProxy->commitsPending()) {
+        emit stopRequest();
+        return;
+    }
+
+    //the instance is deleted once the last delivered offsets are committed, or after a timeout
+    auto done = std::make_shared<bool>(false);
+    auto finish = [this, done] {
+        if (*done) return;
+        *done = true;
+        emit stopRequest();
+    };
+    connect(mProxy.get(), &KafkaProxyV2::offsetCommitted, this, [this, finish] {
+        if (!mProxy->commitsPending()) finish();
+    });
+    connect(mProxy.get(), &KafkaProxyV2::offsetCommitFailed, this, finish);
+    QTimer::singleShot(kShutdownCommitMs, this, finish);
+    qDebug() << "committing the delivered offsets before shutdown";
+    mProxy->commitDeliveredOffsets();
 }
 
 
@@ -113,4 +139,17 @@ void KafkaConsumer::createProxy(bool verbose, const QString& mediaType) {
     auto proxyPass = settings.value("ConfluentRestProxy/password").toString();
 
     mProxy.reset(new KafkaProxyV2(proxyServer, proxyUser, proxyPass, verbose, mediaType));
+
+    KafkaProxyV2::FetchOptions fetch;
+    fetch.maxBytes = settings.value("ConfluentRestProxy/fetchMaxBytes", fetch.maxBytes).toLongLong();
+    fetch.timeoutMs = settings.value("ConfluentRestProxy/fetchTimeoutMs", fetch.timeoutMs).toInt();
+    fetch.minBytes = settings.value("ConfluentRestProxy/fetchMinBytes", fetch.minBytes).toInt();
+    fetch.requestTimeoutMs = settings.value("ConfluentRestProxy/consumerRequestTimeoutMs", fetch.requestTimeoutMs).toInt();
+    fetch.adaptive = settings.value("ConfluentRestProxy/fetchAdaptive", fetch.adaptive).toBool();
+    fetch.adaptiveMinBytes = settings.value("ConfluentRestProxy/fetchMaxBytesMin", fetch.adaptiveMinBytes).toLongLong();
+    fetch.adaptiveMaxBytes = settings.value("ConfluentRestProxy/fetchMaxBytesMax", fetch.adaptiveMaxBytes).toLongLong();
+    mProxy->setFetchOptions(fetch);
+    mCommitPolicy.reset(new CommitPolicy(settings.value("ConfluentRestProxy/commitEveryRecords", 1).toInt(),
+                                         settings.value("ConfluentRestProxy/commitIntervalMs", 0).toInt(),
+                                         settings.value("ConfluentRestProxy/commitOnShutdown", true).toBool()));
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include "kafka_proxy_v2.h"
 #include "kafka_messages.h"
+#include "commit_policy.h"
 #include <QStateMachine>
 #include <QObject>
 #include <qjsondocument.h>
@@ -11,6 +12,8 @@ class KafkaConsumer : public QObject {
     std::unique_ptr<KafkaProxyV2> mProxy;
     QStateMachine mSM;
     QString mGroupName;
+    std::unique_ptr<CommitPolicy> mCommitPolicy;
+    qint32 mFetched {0};
 
     QString generateRandomId();
     void createProxy(bool verbose, const QString& mediaType);
@@ -22,6 +25,8 @@ public:
     KafkaConsumer(const QString& group, const QStringList& topics, bool verbose, const QString& mediaType);
     void start();
     void stop();
+    //delivered and committed offsets per (topic, partition)
+    const OffsetTracker& offsets() const {return mProxy->offsets();}
 signals:
     void failed(QString message);
     void receivedJson(InputMessage<QJsonDocument> message);
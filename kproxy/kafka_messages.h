@@ -13,7 +13,7 @@ template<typename T>
 struct InputMessage {
     QString key;
     QString topic;
-    qint32 offset;
+    qint64 offset;
     qint32 partition;
     T value;
 };
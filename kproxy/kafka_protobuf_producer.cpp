@@ -3,245 +3,692 @@
 #include "kafka_messages.h"
 #include "kafka_proxy_v2.h"
 #include "schema_registry.h"
+#include "segmented_outbox.h"
+#include "wire_format.h"
 #include <qdebug.h>
 #include <qjsonarray.h>
 #include <qjsondocument.h>
 #include <qjsonobject.h>
 #include <qstringliteral.h>
-
+#include <qthread.h>
+#include <algorithm>
+
+namespace {
+    //records staged past their lane's share of readAhead are bounded by this many readAheads
+    constexpr qint32 kReadAheadOverflow = 4;
+
+    //length of the utf8 encoding the key is sent in, without converting it
+    qint64 utf8Size(const QString& text) {
+        qint64 size = 0;
+        for (auto c: text) {
+            auto u = c.unicode();
+            size += u < 0x80 ? 1 : u < 0x800 ? 2 : c.isSurrogate() ? 2 : 3; //a surrogate pair is 4 bytes
+        }
+        return size;
+    }
+}
 
 KafkaProtobufProducer::KafkaProtobufProducer(bool verbose): mVerbose{verbose}
 {
+    mClock.start();
     createObjects();
 
-    auto readSchema = new QState(&mSM);
     auto getClusterId = new QState(&mSM);
-    auto waitForData = new QState(&mSM);
-    auto sendConfirmed = new QState(&mSM);
-    auto sendFailed = new QState(&mSM);
-    auto send = new QState(&mSM);
-
-    readSchema->addTransition(this, &KafkaProtobufProducer::schemaReady, getClusterId);
-    getClusterId->addTransition(mProxy.get(), &HttpClient::initialized, waitForData);
-
-    waitForData->addTransition(this, &KafkaProtobufProducer::newData, send);
+    auto running = new QState(&mSM);
 
-    send->addTransition(mProxy.get(), &HttpClient::messageSent, sendConfirmed);
-    send->addTransition(mProxy.get(), &HttpClient::failed, sendFailed);
+    //the schema ids are not part of the bootstrap. The topics waiting in the outbox are
+    //resolved while the proxy is initialized, the others when they are first sent
+    getClusterId->addTransition(mProxy.get(), &HttpClient::initialized, running);
 
-    sendConfirmed->addTransition(this, &KafkaProtobufProducer::newData, waitForData);
-    sendFailed->addTransition(waitForData); //log error and immediately wait for more
+    connect(getClusterId, &QState::entered, this, &KafkaProtobufProducer::onRequestClusterId);
+    connect(running, &QState::entered, this, &KafkaProtobufProducer::onRunning);
 
+    //once running, the send window is driven by newData and by the send confirmations
+    connect(this, &KafkaProtobufProducer::newData, this, &KafkaProtobufProducer::pump);
 
-    connect(readSchema,  &QState::entered, this, &KafkaProtobufProducer::onRequestSchema);
-    connect(getClusterId, &QState::entered, this, &KafkaProtobufProducer::onRequestClusterId);
-    connect(waitForData, &QState::entered, this, &KafkaProtobufProducer::onWaitForData);
-    connect(send, &QState::entered, this, &KafkaProtobufProducer::onSend);
+    mWakeup.setSingleShot(true);
+    connect(&mWakeup, &QTimer::timeout, this, &KafkaProtobufProducer::pump);
+    connect(mBreaker.get(), &CircuitBreaker::probeReady, this, &KafkaProtobufProducer::pump);
+    connect(mBreaker.get(), &CircuitBreaker::stateChanged, this, &KafkaProtobufProducer::circuitStateChanged);
 
-    connect(sendConfirmed, &QState::entered, this, &KafkaProtobufProducer::onSendConfirmed);
-    connect(sendFailed, &QState::entered, this, &KafkaProtobufProducer::onSendFailed);
-    
-    mSM.setInitialState(readSchema);
+    mSM.setInitialState(getClusterId);
     mSM.start();
 }
 
 QString KafkaProtobufProducer::randomId() {
     auto now = QDateTime::currentDateTimeUtc();
     auto epoch = now.toSecsSinceEpoch();
-    QByteArray random;
-    QFile f("/dev/random");
-    if (f.open(QIODevice::ReadOnly)) {
-        random = f.read(4);
+    //the system generator never waits for entropy, unlike reading /dev/random
+    auto random = QRandomGenerator::system()->generate();
+
+    return QString("protobuf-%1-%2").arg(random, 8, 16, QChar('0')).arg(epoch);
+}
+
+
+void KafkaProtobufProducer::onRequestClusterId() {
+    qDebug() << "----- initialize the proxy with customerId";
+    mProxy->initialize(randomId());
+    prefetchSchemaIds();
+}
+
+
+void KafkaProtobufProducer::prefetchSchemaIds() {
+    stage();
+    for (const auto& lane: mLanes) {
+        if (!lane.staged.isEmpty()) {
+            resolveSchemaId(lane.staged.first().message.topic);
+        }
     }
+}
+
+
+bool KafkaProtobufProducer::resolveSchemaId(const QString& topic) {
+    auto it = mTopicSchemaId.constFind(topic);
+    bool known = it != mTopicSchemaId.constEnd();
+    if (known && mClock.elapsed() < it->expiresAt) return true;
 
-    return QString("protobuf-%1-%2").arg(random.toHex()).arg(epoch);
+    auto subject = topic + "-value";
+    if (!mResolving.contains(subject)) {
+        qDebug() << "resolve schema id of" << subject;
+        mResolving.insert(subject);
+        mRegistry->getLatestSchemaId(subject);
+    }
+    return known; //an expired id stays in use until the new one arrives
 }
 
 
-void KafkaProtobufProducer::onRequestSchema() {
-    qDebug() << "request the schema";
-    mRegistry->getSchemas();
+void KafkaProtobufProducer::onSubjectSchemaId(QString subject, qint32 schemaId) {
+    if (!mResolving.contains(subject)) return;
+
+    auto topic = subject.chopped(QStringLiteral("-value").length());
+    auto it = mTopicSchemaId.find(topic);
+    if (schemaId == -1) {
+        if (it != mTopicSchemaId.end()) {
+            schemaId = it->schemaId;
+            qWarning() << "schema id of" << subject << "not received from the registry, keeping" << schemaId;
+        } else if (auto known = mSchemaCache->find(subject); known) {
+            schemaId = known->schemaId;
+            qWarning() << "schema id of" << subject << "not received from the registry, using" << schemaId;
+        } else if (mRejected.contains(subject)) {
+            //no schema for the topic, its records are sent without the header until the next lookup
+            qWarning() << "subject" << subject << "not found in the registry, sending without a schema id";
+        } else {
+            //without an id the records would be sent without the header and rejected by the
+            //consumers. They stay in their lane, the subject is asked for again after a backoff
+            auto delay = retryDelay(++mSchemaFailures[subject]);
+            qWarning() << "schema id of" << subject << "not received from the registry, retry in" << delay << "ms";
+            QTimer::singleShot(delay, this, [this, subject]() {
+                if (mResolving.contains(subject)) {
+                    mRegistry->getLatestSchemaId(subject);
+                }
+            });
+            return;
+        }
+    }
+    mResolving.remove(subject);
+    mSchemaFailures.remove(subject);
+    mRejected.remove(subject);
+
+    bool changed = it != mTopicSchemaId.end() && it->schemaId != schemaId;
+
+    //the batches already sent keep their id, the new one is stamped from the next dispatch
+    mTopicSchemaId[topic] = {schemaId, mClock.elapsed() + mSchemaTtlMs};
+    if (changed) {
+        qDebug() << "schema id of" << topic << "changed to" << schemaId;
+        emit schemaIdChanged(topic, schemaId);
+    }
+    pump();
 }
 
 
+void KafkaProtobufProducer::onSubjectRejected(QString subject, qint32 httpStatus) {
+    //only the network errors and the server errors are retried
+    if (mResolving.contains(subject)) {
+        qWarning() << "schema registry rejected" << subject << "with error" << httpStatus;
+        mRejected.insert(subject);
+    }
+}
+
 
-void KafkaProtobufProducer::onSchemaReceived(QList<SchemaRegistry::Schema> schemas) {
-    qDebug() << "--- onSchemaReceived";
-    updateSchemaIds(schemas);
-    if (!mLocalSchemaFile.isEmpty()) {
-	saveLocalSchema(schemas);
+void KafkaProtobufProducer::onSchemaRefresh() {
+    //ask again for every topic in use. The current ids stay valid until the replies arrive
+    for (auto it = mTopicSchemaId.constBegin(); it != mTopicSchemaId.constEnd(); ++it) {
+        auto subject = it.key() + "-value";
+        if (!mResolving.contains(subject)) {
+            mResolving.insert(subject);
+            mRegistry->getLatestSchemaId(subject);
+        }
     }
-    qDebug() << "---- emit schema ready";
-    emit schemaReady();
 }
 
-void KafkaProtobufProducer::onRequestClusterId() {
-    qDebug() << "----- schema received. initialize the proxy with customerId";
-    mProxy->initialize(randomId());
+
+void KafkaProtobufProducer::onLatestSchema(SchemaRegistry::Schema schema) {
+    auto known = mSchemaCache->find(schema.subject);
+    if (known && known->schemaId == schema.schemaId) return;
+
+    mSchemaCache->update(schema);
+}
+
+
+
+void KafkaProtobufProducer::onRunning() {
+    qDebug() << "KafkaProtobufProducer running. persistent queue size:" << mPersistentQueue->size()
+             << "in-flight window:" << mMaxInFlight;
+    if (mVerbose) {
+        qDebug().noquote() << QString("bootstrap finished after %1 ms").arg(mClock.elapsed());
+    }
+    mRunning = true;
+    if (mReplayRemaining > 0) {
+        mReplayClock.start();
+    }
+    pump();
+}
+
+
+qint32 KafkaProtobufProducer::schemaIdOf(const QString& topic) const {
+    auto it = mTopicSchemaId.constFind(topic);
+    return it != mTopicSchemaId.constEnd() ? it->schemaId : -1;
+}
+
+
+qint64 KafkaProtobufProducer::encodedSize(const OutputBinaryMessage& message) {
+    //{"key":"<base64>","value":"<base64>"}, with the schema registry header in front of the value
+    auto base64 = [](qint64 size) {return (size + 2) / 3 * 4;};
+    return 24 + base64(utf8Size(message.key)) + base64(message.value.size() + 6);
+}
+
+
+QString KafkaProtobufProducer::laneOf(const OutputBinaryMessage& message) const {
+    return mLaneByKey ? QString("%1/%2").arg(message.topic, message.key) : message.topic;
+}
+
+
+QStringList KafkaProtobufProducer::laneOrder() const {
+    //start after the lane served last, so every lane gets its turn
+    auto lanes = mLanes.keys();
+    auto next = std::upper_bound(lanes.begin(), lanes.end(), mLastLane);
+    std::rotate(lanes.begin(), next, lanes.end());
+    return lanes;
+}
+
+
+qint32 KafkaProtobufProducer::readAheadUsed() const {
+    //every lane uses at most its share of the read-ahead, the records a lane holds above it
+    //do not stop the outbox from being read for the other lanes
+    auto share = qMax(mBatchMaxRecords, mReadAhead / qMax(1, qint32(mLanes.size())));
+    qint32 used = 0;
+    for (const auto& lane: mLanes) {
+        used += qMin(qint32(lane.staged.size()), share);
+    }
+    return used;
+}
+
+
+void KafkaProtobufProducer::stage() {
+    //size() counts all records which are not confirmed yet, including the ones already taken with next().
+    //Compaction frees read-ahead room, so a backlog of a compacted topic is read until only
+    //the distinct keys are left
+    QSet<QString> compactLanes;
+    while (mPersistentQueue->size() > mPulledRecords && mStagedRecords < mReadAhead * kReadAheadOverflow &&
+           readAheadUsed() < mReadAhead) {
+        auto group = mPersistentQueue->next();
+        if (group.isEmpty()) {
+            qWarning() << "No data to send in persistent queue group";
+            emit error();
+            break;
+        }
+
+        auto groupId = ++mLastGroup;
+        qint64 bytes = 0;
+        //records from the previous run come first and were not counted on append
+        auto recovered = qMin(qint32(group.size()), mRecoveredRecords);
+        mRecoveredRecords -= recovered;
+        mPulledRecords += group.size();
+        mStagedRecords += group.size();
+        for (const auto& item: group) {
+            StagedRecord record{groupId, {item.key, item.topic, item.payload}};
+            if (recovered-- > 0) {
+                mPendingBytes += item.payload.size();
+            }
+            bytes += item.payload.size();
+            auto lane = laneOf(record.message);
+            if (mCompactTopics.contains(item.topic)) {
+                compactLanes << lane;
+            }
+            mLanes[lane].staged << record;
+        }
+        mGroups.insert(groupId, {qint32(group.size()), qint32(group.size()), bytes});
+
+        if (mStagedRecords >= mReadAhead && !compactLanes.isEmpty()) {
+            qint32 dropped = 0;
+            for (const auto& lane: std::as_const(compactLanes)) {
+                dropped += compact(mLanes[lane]);
+            }
+            compactLanes.clear();
+            if (dropped > 0) {
+                confirmCompleted();
+            }
+        }
+    }
+
+    qint32 dropped = 0;
+    for (const auto& lane: std::as_const(compactLanes)) {
+        dropped += compact(mLanes[lane]);
+    }
+    if (dropped > 0) {
+        confirmCompleted();
+    }
 }
 
 
-void KafkaProtobufProducer::updateSchemaIds(const QList<SchemaRegistry::Schema>& schemas) {
-    const auto kValueSuffix = QStringLiteral("-value");
-    QMap<QString, qint32> schemaVersion;
+qint32 KafkaProtobufProducer::compact(Lane& lane) {
+    //keep the last staged record of every key of a compacted topic. The group of a dropped
+    //record counts it as sent, the newer value stays unconfirmed in the outbox until it is sent
+    QSet<QString> seen;
+    QList<StagedRecord> kept;
+    kept.reserve(lane.staged.size());
+    for (auto it = lane.staged.rbegin(); it != lane.staged.rend(); ++it) {
+        const auto& message = it->message;
+        if (mCompactTopics.contains(message.topic) && !message.key.isEmpty()) {
+            if (seen.contains(message.key)) {
+                mGroups[it->group].unsent--;
+                continue;
+            }
+            seen << message.key;
+        }
+        kept << std::move(*it);
+    }
+
+    qint32 dropped = lane.staged.size() - kept.size();
+    if (dropped == 0) return 0;
+
+    std::reverse(kept.begin(), kept.end());
+    lane.staged = std::move(kept);
+    mStagedRecords -= dropped;
+    mCompacted += dropped;
+    if (mVerbose) {
+        qDebug() << "Compacted" << dropped << "records," << lane.staged.size() << "left to send";
+    }
+    return dropped;
+}
 
-    mTopicSchemaId.clear();
-    for (const auto& schema: schemas) {
-        const auto& s = schema.subject;
-        if (!s.endsWith(kValueSuffix)) continue;
 
-        auto topicLength = s.length() - kValueSuffix.length();
-        auto topic = s.left(topicLength);
-        if (!schemaVersion.contains(topic) || schemaVersion[topic] < schema.version) {
-            //keep only the latest version
-            mTopicSchemaId[topic] = schema.schemaId;
-            schemaVersion[topic] = schema.version;
+bool KafkaProtobufProducer::takeBatch(Lane& lane, Batch& batch) {
+    if (lane.staged.isEmpty()) return false;
+
+    //a key is in one request at a time, so a retry can not overtake a newer record of that key.
+    //Records without a key have no order in kafka
+    auto blocked = [&lane](const OutputBinaryMessage& message) {
+        return !message.key.isEmpty() && lane.keys.contains(message.key);
+    };
+
+    qint32 count = 0;
+    qint64 bytes = 0;
+    while (count < lane.staged.size() && count < mBatchMaxRecords) {
+        const auto& message = lane.staged[count].message;
+        if (blocked(message)) break;
+        auto size = encodedSize(message);
+        if (count > 0 && bytes + size > mBatchMaxBytes) break;
+        bytes += size;
+        count++;
+    }
+    if (count == 0) return false;
+
+    //a batch which could still grow waits up to lingerMs for more records
+    bool complete = count < lane.staged.size() || count >= mBatchMaxRecords || bytes >= mBatchMaxBytes;
+    if (!complete && mLingerMs > 0) {
+        auto now = mClock.elapsed();
+        if (lane.lingerDeadline < 0) {
+            lane.lingerDeadline = now + mLingerMs;
+        }
+        if (now < lane.lingerDeadline) return false;
+    }
+    lane.lingerDeadline = -1;
+
+    batch.topic = lane.staged.first().message.topic;
+    batch.bytes = bytes;
+    for (qint32 i = 0; i < count; i++) {
+        auto record = lane.staged.takeFirst();
+        if (!record.message.key.isEmpty()) {
+            lane.keys[record.message.key]++;
         }
+        batch.groups << record.group;
+        batch.records << std::move(record.message);
     }
+    mStagedRecords -= count;
+    return true;
+}
+
+
+qint64 KafkaProtobufProducer::retryDelay(qint32 failures) const {
+    //exponential growth, then a random value in the upper half to spread the retries of many producers
+    auto delay = qint64(mRetryBackoffMs) << qMin(failures - 1, 20);
+    delay = qMin(delay, qint64(mRetryBackoffMaxMs));
+    return delay / 2 + QRandomGenerator::global()->bounded(delay / 2 + 1);
 }
 
-QList<SchemaRegistry::Schema> KafkaProtobufProducer::loadLocalSchema() {
-    QFile f(mLocalSchemaFile);
-    if (!f.open(QIODevice::ReadOnly)) {
-	qWarning() << "Failed to create" << mLocalSchemaFile;
-	return {};
-    }
-    QList<SchemaRegistry::Schema> result;
-    auto doc = QJsonDocument::fromJson(f.readAll());
-    for (const auto& item: doc.array()) {
-	auto s = item.toObject();
-	SchemaRegistry::Schema schema;
-	schema.schemaId = s["schemaId"].toInt();
-        schema.schema = s["schema"].toString();
-        schema.schemaType = s["schemaType"].toString();
-        schema.subject = s["subject"].toString();
-        schema.version = s["version"].toInt();
-
-	auto references = s["references"].toArray();
-	for (const auto& ref: references) {
-	    auto r = ref.toObject();
-	    SchemaRegistry::Reference reference;
-	    reference.name = r["name"].toString();
-	    reference.subject = r["subject"].toString();
-	    reference.version = r["version"].toInt();
-	 
-	    schema.references.append(reference);
-	}
-	result.append(schema);
-    }
-    return result;
-}
-
-void KafkaProtobufProducer::saveLocalSchema(const QList<SchemaRegistry::Schema>& schemas) {
-    QFile f(mLocalSchemaFile);
-    if (!f.open(QIODevice::WriteOnly | QIODevice::Text)) {
-	qWarning() << "Failed to create" << mLocalSchemaFile;
-	return;
-    }
-    QJsonArray array;
-    for (const auto& schema: schemas) {
-	QJsonObject s;
-	s["schemaId"] = schema.schemaId;
-        s["schema"] = schema.schema;
-        s["schemaType"] = schema.schemaType;
-        s["subject"] = schema.subject;
-        s["version"] = schema.version;
-	QJsonArray references;
-	for(const auto& r: schema.references) {
-	    QJsonObject ref;
-	    ref["name"] = r.name;
-	    ref["subject"] = r.subject;
-	    ref["version"] = r.version;
-	    references.append(ref);
-	}
-	s["references"] = references;
-	array.append(s);
-    }
-    QJsonDocument doc(array);
-    auto bytes = doc.toJson();
-    f.write(bytes);
-}
-
-
-void KafkaProtobufProducer::onSchemaReadingFailed(const QString& reason) {
-    qWarning() << "schema reading failed:" << reason;
-    auto schemas = loadLocalSchema();
-    if (!schemas.isEmpty()) {
-	updateSchemaIds(schemas);
-    }
-    emit schemaReady();
-}
-
-
-
-void KafkaProtobufProducer::onWaitForData() {
-    qDebug() << "KafkaProtobufProducer::onWaitForData. persistent queue size: " << mPersistentQueue->size();
-    if (mPersistentQueue->size()) {
-        emit newData();
-    }
-}
-
-void KafkaProtobufProducer::onSend() {
-    if (!mPersistentQueue->size()) {
-        qWarning() << "Empty queue for proxy send!";
-        emit error();
+
+KafkaProtobufProducer::RateLimit KafkaProtobufProducer::rateLimit(QSettings& settings, const QString& prefix) {
+    //burst defaults to one second of traffic
+    auto records = settings.value(prefix + "rateRecords", 0).toDouble();
+    auto bytes = settings.value(prefix + "rateBytes", 0).toDouble();
+    return {TokenBucket(records, settings.value(prefix + "rateBurstRecords", records).toDouble()),
+            TokenBucket(bytes, settings.value(prefix + "rateBurstBytes", bytes).toDouble())};
+}
+
+
+qint64 KafkaProtobufProducer::throttleMs(const Batch& batch) {
+    auto now = mClock.elapsed();
+    auto wait = qMax(mGlobalRate.records.waitMs(batch.records.size(), now), mGlobalRate.bytes.waitMs(batch.bytes, now));
+
+    auto it = mTopicRates.find(batch.topic);
+    if (it != mTopicRates.end()) {
+        wait = qMax(wait, qMax(it->records.waitMs(batch.records.size(), now), it->bytes.waitMs(batch.bytes, now)));
+    }
+    return wait;
+}
+
+
+void KafkaProtobufProducer::takeRate(const Batch& batch) {
+    auto now = mClock.elapsed();
+    mGlobalRate.records.take(batch.records.size(), now);
+    mGlobalRate.bytes.take(batch.bytes, now);
+
+    auto it = mTopicRates.find(batch.topic);
+    if (it != mTopicRates.end()) {
+        it->records.take(batch.records.size(), now);
+        it->bytes.take(batch.bytes, now);
+    }
+}
+
+
+void KafkaProtobufProducer::scheduleWakeup() {
+    //a full window is reopened by the next send confirmation and an open breaker by
+    //probeReady, no lane can send before
+    if (mInFlight.size() >= mMaxInFlight || mBreaker->state() == CircuitBreaker::State::Open) {
+        mWakeup.stop();
         return;
     }
 
-    QList<QByteArray> toSend;
-    auto group = mPersistentQueue->next();
-    if (group.isEmpty()) {
-        qWarning() << "No data to send in persistent queue group";
-        emit error();
+    //the next lane which stops lingering or waiting for a retry. A deadline which has
+    //passed belongs to a lane that pump() could not serve, waking it up again would spin
+    auto now = mClock.elapsed();
+    qint64 deadline = -1;
+    for (const auto& lane: mLanes) {
+        for (auto t: {lane.lingerDeadline, lane.retryAt}) {
+            if (t > now && (deadline < 0 || t < deadline)) {
+                deadline = t;
+            }
+        }
+    }
+
+    if (deadline < 0) {
+        mWakeup.stop();
+    } else {
+        mWakeup.start(deadline - now);
+    }
+}
+
+
+void KafkaProtobufProducer::pump() {
+    if (!mRunning) {
+        if (mSM.isRunning()) {
+            prefetchSchemaIds();
+        }
         return;
     }
 
-    auto common = group.first();
-    qint32 schemaId = -1;
-    auto it = mTopicSchemaId.find(common.topic);
-    if (it != mTopicSchemaId.end()) {
-        schemaId = *it;
+    bool progress = true;
+    while (progress && mInFlight.size() < mMaxInFlight) {
+        progress = false;
+        stage();
+        for (const auto& name: laneOrder()) {
+            if (mInFlight.size() >= mMaxInFlight) break;
+
+            auto& lane = mLanes[name];
+            if (lane.retryAt >= 0 && mClock.elapsed() < lane.retryAt) continue;
+
+            //a failed batch is sent again before the lane takes new records
+            auto waiting = std::find_if(lane.batches.cbegin(), lane.batches.cend(),
+                                        [this](quint64 sequence) {return !mBatches[sequence].inFlight;});
+            quint64 sequence = waiting != lane.batches.cend() ? *waiting : 0;
+            if (!sequence) {
+                //records of a topic wait until its schema id is known
+                if (lane.staged.isEmpty() || !resolveSchemaId(lane.staged.first().message.topic)) continue;
+                Batch batch;
+                if (!takeBatch(lane, batch)) continue;
+                batch.lane = name;
+                sequence = ++mLastSequence;
+                lane.batches << sequence;
+                mBatches.insert(sequence, batch);
+            }
+            auto wait = throttleMs(mBatches[sequence]);
+            if (wait > 0) {
+                lane.retryAt = mClock.elapsed() + wait;
+                continue;
+            }
+            if (!mBreaker->allowRequest()) break;
+            lane.retryAt = -1;
+            takeRate(mBatches[sequence]);
+            dispatch(sequence);
+            mLastLane = name;
+            progress = true;
+        }
     }
-    for (const auto& item: group) {
-        toSend << addSchemaRegistryId(schemaId, item.payload);
+
+    for (auto it = mLanes.begin(); it != mLanes.end();) {
+        if (it->staged.isEmpty() && it->batches.isEmpty()) {
+            it = mLanes.erase(it);
+        } else {
+            ++it;
+        }
     }
-    qDebug() << "send to" << common.topic;
-    mProxy->sendBinary(common.key, common.topic, toSend);
+    scheduleWakeup();
 }
 
 
-void KafkaProtobufProducer::onSendConfirmed() {
-    qDebug() << "Send confirmed";
-    mPersistentQueue->confirm();
-    emit newData();
+void KafkaProtobufProducer::dispatch(quint64 sequence) {
+    auto& batch = mBatches[sequence];
+
+    //the header is added while the values are encoded, the payloads are not copied
+    qDebug() << "send" << batch.records.size() << "records to" << batch.topic << "batch" << sequence;
+    auto requestId = mProxy->sendRecords(batch.topic, batch.records, schemaIdOf(batch.topic));
+    mInFlight.insert(requestId, sequence);
+    batch.inFlight = true;
 }
 
-void KafkaProtobufProducer::onSendFailed() {
-    qWarning() << "message sending has failed";
+
+void KafkaProtobufProducer::confirmCompleted() {
+    //the persistent queue confirms the oldest group, so a group completed out of order waits for its predecessors
+    while (!mGroups.isEmpty() && mGroups.first().unsent == 0) {
+        mPulledRecords -= mGroups.first().records;
+        mPendingBytes = qMax(0LL, mPendingBytes - mGroups.first().bytes);
+        mPersistentQueue->confirm();
+        if (mReplayRemaining > 0 && (mReplayRemaining -= mGroups.first().records) <= 0) {
+            auto ms = qMax(1LL, mReplayClock.elapsed());
+            qDebug().noquote() << QString("replayed %1 records from the outbox in %2 ms, %3 records/s")
+                                  .arg(mReplayRecords).arg(ms).arg(mReplayRecords * 1000LL / ms);
+        }
+        mGroups.erase(mGroups.begin());
+    }
+    updateBackpressure();
+}
+
+
+void KafkaProtobufProducer::onBatchSent(qint64 requestId, qint64 latencyMs) {
+    auto it = mInFlight.find(requestId);
+    if (it == mInFlight.end()) return;
+
+    auto sequence = *it;
+    mInFlight.erase(it);
+    qDebug() << "Send confirmed, batch" << sequence << "in" << latencyMs << "ms";
+
+    mLastLatencyMs = latencyMs;
+    mBreaker->recordSuccess();
+    if (mController) {
+        mController->recordSuccess(latencyMs);
+    }
+    if (!mFirstSendReported) {
+        mFirstSendReported = true;
+        if (mVerbose) {
+            qDebug().noquote() << QString("time to first send %1 ms").arg(mClock.elapsed());
+        }
+    }
+
+    auto batch = mBatches.take(sequence);
+    auto& lane = mLanes[batch.lane];
+    lane.batches.removeOne(sequence);
+    lane.failures = 0;
+    for (const auto& record: batch.records) {
+        if (!record.key.isEmpty() && --lane.keys[record.key] == 0) {
+            lane.keys.remove(record.key);
+        }
+    }
+    for (auto group: batch.groups) {
+        mGroups[group].unsent--;
+    }
+    confirmCompleted();
+    pump();
+}
+
+
+void KafkaProtobufProducer::onBatchFailed(qint64 requestId, QString message, qint64 latencyMs) {
+    auto it = mInFlight.find(requestId);
+    if (it == mInFlight.end()) return;
+
+    auto sequence = *it;
+    mInFlight.erase(it);
+    mLastLatencyMs = latencyMs;
+    mBreaker->recordFailure();
+    if (mController) {
+        mController->recordFailure(latencyMs);
+    }
+
+    //the batch stays in its lane and is sent again before the lane takes new records. Its keys
+    //stay blocked, the other batches of the lane in flight hold other keys
+    auto& batch = mBatches[sequence];
+    batch.inFlight = false;
+    auto& lane = mLanes[batch.lane];
+    lane.failures++;
+    auto delay = retryDelay(lane.failures);
+    lane.retryAt = mClock.elapsed() + delay;
+    qWarning() << "message sending has failed, batch" << sequence << message << "retry in" << delay << "ms";
+    pump();
 }
 
 
 QByteArray KafkaProtobufProducer::addSchemaRegistryId(qint32 schemaId, const QByteArray& input) {
     if (schemaId == -1) return input;
 
-    QByteArray data;
-    auto header = std::array<quint8,6> {0x00, //magic
-                                        (quint8)(schemaId >> 24),
-                                        (quint8)(schemaId >> 16),
-                                        (quint8)(schemaId >> 8),
-                                        (quint8)(schemaId >> 0),
-                                        0x00}; //the first message in the proto file
-    std::copy(header.begin(), header.end(), std::back_inserter(data));
-    std::copy(input.begin(), input.end(), std::back_inserter(data));
+    QByteArray data(WireFormat::kHeaderSize + input.size(), Qt::Uninitialized);
+    WireFormat::writeHeader(data.data(), schemaId);
+    memcpy(data.data() + WireFormat::kHeaderSize, input.constData(), input.size());
     return data;
 }
 
+void KafkaProtobufProducer::appendToOutbox(const OutputBinaryMessage& message, QByteArray&& value) {
+    //a record dropped by the outbox is not pending
+    auto bytes = value.size();
+    if (mPersistentQueue->append(message.topic, message.key, std::move(value))) {
+        mPendingBytes += bytes;
+    }
+}
+
+void KafkaProtobufProducer::updateBackpressure() {
+    auto count = pendingCount();
+    if (!mBackpressure) {
+        if ((mHighWaterRecords > 0 && count >= mHighWaterRecords) ||
+            (mHighWaterBytes > 0 && mPendingBytes >= mHighWaterBytes)) {
+            mBackpressure = true;
+            qWarning() << "Outbox backpressure on," << count << "records," << mPendingBytes << "bytes";
+            emit backpressureOn();
+        }
+    } else if ((mHighWaterRecords <= 0 || count <= mLowWaterRecords) &&
+               (mHighWaterBytes <= 0 || mPendingBytes <= mLowWaterBytes)) {
+        mBackpressure = false;
+        qDebug() << "Outbox backpressure off," << count << "records," << mPendingBytes << "bytes";
+        emit backpressureOff();
+    }
+}
+
+qint32 KafkaProtobufProducer::pendingCount() const {
+    return mPersistentQueue->size();
+}
+
 void KafkaProtobufProducer::send(OutputBinaryMessage data) {
-    mPersistentQueue->append(data.topic, data.key, data.value);
+    appendToOutbox(data, std::move(data.value));
+    updateBackpressure();
+    emit newData();
+}
+
+void KafkaProtobufProducer::send(QList<OutputBinaryMessage>&& messages) {
+    if (messages.isEmpty()) return;
+
+    for (auto& message: messages) {
+        appendToOutbox(message, std::move(message.value));
+    }
+    messages.clear();
+    updateBackpressure();
+    emit newData();
+}
+
+void KafkaProtobufProducer::send(QSpan<const OutputBinaryMessage> messages) {
+    if (messages.empty()) return;
+
+    for (const auto& message: messages) {
+        appendToOutbox(message, QByteArray(message.value));
+    }
+    updateBackpressure();
     emit newData();
 }
 
+bool KafkaProtobufProducer::post(OutputBinaryMessage message) {
+    qint32 attempts = 0;
+    while (!mIngress->tryPush(std::move(message))) {
+        switch (mIngressPolicy) {
+        case IngressPolicy::Fail:
+            return false;
+        case IngressPolicy::DropOldest: {
+            OutputBinaryMessage dropped;
+            if (mIngress->tryPop(dropped)) {
+                mIngressDropped++;
+            }
+            break;
+        }
+        case IngressPolicy::Block:
+            //wait for the producer thread to drain the ring
+            if (++attempts < 100) {
+                QThread::yieldCurrentThread();
+            } else {
+                QThread::usleep(100);
+            }
+            break;
+        }
+    }
+
+    //one queued call drains everything posted until it runs
+    if (!mDrainScheduled.exchange(true)) {
+        QMetaObject::invokeMethod(this, &KafkaProtobufProducer::drainIngress, Qt::QueuedConnection);
+    }
+    return true;
+}
+
+
+void KafkaProtobufProducer::drainIngress() {
+    mDrainScheduled = false;
+
+    QList<OutputBinaryMessage> messages;
+    OutputBinaryMessage message;
+    while (mIngress->tryPop(message)) {
+        messages << std::move(message);
+    }
+    send(std::move(messages));
+}
+
+
 void KafkaProtobufProducer::stop() {
+    mRunning = false;
+    mSchemaRefresh.stop();
     mSM.stop();
 }
 
@@ -251,21 +698,101 @@ void KafkaProtobufProducer::createObjects() {
     auto schemaServer = settings.value("ConfluentSchemaRegistry/server").toString();
     auto schemaUser = settings.value("ConfluentSchemaRegistry/user").toString();
     auto schemaPass = settings.value("ConfluentSchemaRegistry/password").toString();
-    mLocalSchemaFile = settings.value("ConfluentSchemaRegistry/localSchema").toString();
+    auto localSchema = settings.value("ConfluentSchemaRegistry/localSchema").toString();
+    auto localSchemaText = settings.value("ConfluentSchemaRegistry/localSchemaText", false).toBool();
+    mSchemaCache.reset(new SchemaCache(localSchema, localSchemaText));
+    mSchemaTtlMs = settings.value("ConfluentSchemaRegistry/schemaTtl", 300000).toInt();
+    auto schemaRefresh = settings.value("ConfluentSchemaRegistry/schemaRefresh", 60000).toInt();
+    if (schemaRefresh > 0) {
+        connect(&mSchemaRefresh, &QTimer::timeout, this, &KafkaProtobufProducer::onSchemaRefresh);
+        mSchemaRefresh.start(schemaRefresh);
+    }
     mRegistry.reset(new SchemaRegistry(schemaServer, schemaUser, schemaPass, mVerbose));
-    connect(mRegistry.get(), &SchemaRegistry::schemaList, this, &KafkaProtobufProducer::onSchemaReceived);
-    connect(mRegistry.get(), &SchemaRegistry::failed, this, &KafkaProtobufProducer::onSchemaReadingFailed);
+    connect(mRegistry.get(), &SchemaRegistry::subjectSchemaId, this, &KafkaProtobufProducer::onSubjectSchemaId);
+    connect(mRegistry.get(), &SchemaRegistry::subjectRejected, this, &KafkaProtobufProducer::onSubjectRejected);
+    connect(mRegistry.get(), &SchemaRegistry::latestSchema, this, &KafkaProtobufProducer::onLatestSchema);
 
     auto outboxFile = settings.value("ConfluentRestProxy/outboxFile", "/tmp/kafka.outbox").toString();
     auto outboxLimit = settings.value("ConfluentRestProxy/outboxLimit", 200000).toInt();
     auto timeToSave = settings.value("ConfluentRestProxy/timeToSave", 30000).toInt();
-    mPersistentQueue.reset(new PQueue(outboxFile, outboxLimit, timeToSave));
+    auto outboxBackend = settings.value("ConfluentRestProxy/outboxBackend", "pqueue").toString();
+    if (outboxBackend == "segmented") {
+        auto outboxDir = settings.value("ConfluentRestProxy/outboxDir", outboxFile + ".d").toString();
+        auto segmentBytes = settings.value("ConfluentRestProxy/outboxSegmentBytes", 64 * 1024 * 1024).toLongLong();
+        auto syncMs = settings.value("ConfluentRestProxy/outboxSyncMs", 10).toInt();
+        mPersistentQueue.reset(new SegmentedOutbox(outboxDir, outboxLimit, segmentBytes, syncMs));
+    } else {
+        mPersistentQueue.reset(new PQueueOutbox(outboxFile, outboxLimit, timeToSave));
+    }
+    mRecoveredRecords = mPersistentQueue->size();
+    mReplayRecords = mRecoveredRecords;
+    mReplayRemaining = mRecoveredRecords;
+
+    mHighWaterRecords = settings.value("ConfluentRestProxy/highWaterRecords", outboxLimit / 10 * 8).toInt();
+    mLowWaterRecords = qBound(0, settings.value("ConfluentRestProxy/lowWaterRecords", mHighWaterRecords / 2).toInt(), mHighWaterRecords);
+    mHighWaterBytes = settings.value("ConfluentRestProxy/highWaterBytes", 0).toLongLong();
+    mLowWaterBytes = qBound(0LL, settings.value("ConfluentRestProxy/lowWaterBytes", mHighWaterBytes / 2).toLongLong(), mHighWaterBytes);
+
+    auto ingressCapacity = qMax(2, settings.value("ConfluentRestProxy/ingressCapacity", 8192).toInt());
+    auto ingressPolicy = settings.value("ConfluentRestProxy/ingressPolicy", "block").toString();
+    mIngress.reset(new IngressRing<OutputBinaryMessage>(ingressCapacity));
+    if (ingressPolicy == "dropOldest") {
+        mIngressPolicy = IngressPolicy::DropOldest;
+    } else if (ingressPolicy == "fail") {
+        mIngressPolicy = IngressPolicy::Fail;
+    } else {
+        mIngressPolicy = IngressPolicy::Block;
+    }
+    mMaxInFlight = qMax(1, settings.value("ConfluentRestProxy/maxInFlight", 1).toInt());
+    mBatchMaxRecords = qMax(1, settings.value("ConfluentRestProxy/batchMaxRecords", 500).toInt());
+    mBatchMaxBytes = qMax(1LL, settings.value("ConfluentRestProxy/batchMaxBytes", 1000000).toLongLong());
+    mLingerMs = qMax(0, settings.value("ConfluentRestProxy/lingerMs", 0).toInt());
+    mLaneByKey = settings.value("ConfluentRestProxy/laneBy", "topic").toString() == "key";
+    for (const auto& topic: settings.value("ConfluentRestProxy/compactTopics").toStringList()) {
+        if (!topic.trimmed().isEmpty()) {
+            mCompactTopics << topic.trimmed();
+        }
+    }
+    mReadAhead = qMax(mBatchMaxRecords, settings.value("ConfluentRestProxy/readAhead", 5000).toInt());
+    if (settings.value("ConfluentRestProxy/adaptiveBatching", false).toBool()) {
+        auto minRecords = settings.value("ConfluentRestProxy/batchMinRecords", 50).toInt();
+        auto step = settings.value("ConfluentRestProxy/batchStep", 50).toInt();
+        auto latencyTarget = settings.value("ConfluentRestProxy/latencyTargetMs", 1000).toInt();
+        mController.reset(new BatchController(minRecords, mBatchMaxRecords, mMaxInFlight, step, latencyTarget));
+        connect(mController.get(), &BatchController::operatingPointChanged, this,
+                [this](qint32 batchRecords, qint32 inFlight, qint64 latencyMs) {
+            mBatchMaxRecords = batchRecords;
+            mMaxInFlight = inFlight;
+            if (mVerbose) {
+                qDebug() << "operating point: batch" << batchRecords << "records, in flight" << inFlight
+                         << "latency" << latencyMs << "ms";
+            }
+            emit operatingPointChanged(batchRecords, inFlight, latencyMs);
+        });
+        mBatchMaxRecords = mController->batchRecords();
+        mMaxInFlight = mController->inFlight();
+    }
+    mRetryBackoffMs = qMax(1, settings.value("ConfluentRestProxy/retryBackoffMs", 100).toInt());
+    mRetryBackoffMaxMs = qMax(mRetryBackoffMs, settings.value("ConfluentRestProxy/retryBackoffMaxMs", 30000).toInt());
+    mGlobalRate = rateLimit(settings, "ConfluentRestProxy/");
+    settings.beginGroup("TopicRateLimits");
+    for (const auto& topic: settings.childGroups()) {
+        mTopicRates.insert(topic, rateLimit(settings, topic + "/"));
+    }
+    settings.endGroup();
+    auto breakerFailures = settings.value("ConfluentRestProxy/breakerFailures", 5).toInt();
+    auto breakerOpenMs = settings.value("ConfluentRestProxy/breakerOpenMs", 30000).toInt();
+    mBreaker.reset(new CircuitBreaker(breakerFailures, breakerOpenMs));
 
     auto proxyServer = settings.value("ConfluentRestProxy/server").toString();
     auto proxyUser = settings.value("ConfluentRestProxy/user").toString();
     auto proxyPass = settings.value("ConfluentRestProxy/password").toString();
 
     mProxy.reset(new KafkaProxyV2(proxyServer, proxyUser, proxyPass, mVerbose, kMediaBinary));
+    mProxy->setRequestCompression(settings.value("ConfluentRestProxy/compression").toString() == "gzip",
+                                  settings.value("ConfluentRestProxy/compressionMinBytes", 1024).toInt());
     connect(mProxy.get(), &KafkaProxyV2::messageSent, this, &KafkaProtobufProducer::messageSent);
     connect(mProxy.get(), &KafkaProxyV2::failed, this, &KafkaProtobufProducer::failed);
+    connect(mProxy.get(), &HttpClient::batchSent, this, &KafkaProtobufProducer::onBatchSent);
+    connect(mProxy.get(), &HttpClient::batchFailed, this, &KafkaProtobufProducer::onBatchFailed);
 }
@@ -2,49 +2,211 @@
 #include <QQueue>
 #include <QObject>
 #include <QtStateMachine/qstatemachine.h>
+#include <atomic>
+#include "batch_controller.h"
+#include "circuit_breaker.h"
 #include "http_client.h"
+#include "ingress_ring.h"
 #include "kafka_messages.h"
+#include "kafka_proxy_v2.h"
+#include "outbox.h"
+#include "schema_cache.h"
 #include "schema_registry.h"
-#include <pqueue/pqueue.h>
+#include "token_bucket.h"
 
 class KafkaProtobufProducer : public QObject {
     Q_OBJECT
-    std::unique_ptr<HttpClient> mProxy;
+public:
+    //what post() does when the ingress ring is full
+    enum class IngressPolicy {Block, DropOldest, Fail};
+private:
+    struct StagedRecord {
+        quint64 group;
+        OutputBinaryMessage message;
+    };
+
+    struct Group {
+        qint32 records;
+        qint32 unsent;
+        qint64 bytes;
+    };
+
+    struct Batch {
+        QString lane;
+        QString topic;
+        QList<OutputBinaryMessage> records;
+        QList<quint64> groups; //outbox group of each record
+        qint64 bytes {0};      //encoded size of the records
+        bool inFlight {false};
+    };
+
+    struct Lane {
+        QList<StagedRecord> staged; //taken from the outbox, not assigned to a batch yet
+        QList<quint64> batches;     //batches in flight or waiting to be sent again, oldest first
+        QHash<QString, qint32> keys; //keys of the records in batches
+        qint64 lingerDeadline {-1};
+        qint32 failures {0};
+        qint64 retryAt {-1};       //retry backoff or rate limit, the lane waits until then
+    };
+
+    struct RateLimit {
+        TokenBucket records;
+        TokenBucket bytes;
+    };
+
+    std::unique_ptr<KafkaProxyV2> mProxy;
     std::unique_ptr<SchemaRegistry> mRegistry;
 
     QStateMachine mSM;
-    std::unique_ptr<PQueue> mPersistentQueue;
+    std::unique_ptr<Outbox> mPersistentQueue;
                         
     void createObjects();
     
-    QMap<QString, qint32> mTopicSchemaId;
+    //schema ids are resolved per topic on first use and kept for mSchemaTtlMs
+    struct CachedSchemaId {
+        qint32 schemaId;
+        qint64 expiresAt;
+    };
+    QHash<QString, CachedSchemaId> mTopicSchemaId;
+    QSet<QString> mResolving;                        //subjects requested from the registry
+    QHash<QString, qint32> mSchemaFailures;          //failed lookups of subjects without any id
+    QSet<QString> mRejected;                         //subjects the registry does not know
+    std::unique_ptr<SchemaCache> mSchemaCache;      //latest schema of every subject, kept in localSchema
+    qint32 mSchemaTtlMs;
+    QTimer mSchemaRefresh;
+
     static QString randomId();
     bool mVerbose;
-    QString mLocalSchemaFile;
-    void saveLocalSchema(const QList<SchemaRegistry::Schema>& schemas);
-    QList<SchemaRegistry::Schema> loadLocalSchema();
-    void updateSchemaIds(const QList<SchemaRegistry::Schema>& schemas);
+    bool resolveSchemaId(const QString& topic);
+    void prefetchSchemaIds();
+    bool mFirstSendReported {false};
+    qint32 schemaIdOf(const QString& topic) const;
+
+    //records posted from other threads, drained in bulk by the producer thread
+    std::unique_ptr<IngressRing<OutputBinaryMessage>> mIngress;
+    IngressPolicy mIngressPolicy {IngressPolicy::Block};
+    std::atomic<bool> mDrainScheduled {false};
+    std::atomic<quint64> mIngressDropped {0};
+    void drainIngress();
+
+    //backpressure. Raised when the outbox reaches a high water mark and cleared once it
+    //drains below both low water marks. Records left in the outbox by the previous run
+    //are added to mPendingBytes when they are taken from the outbox
+    qint32 mHighWaterRecords;
+    qint32 mLowWaterRecords;
+    qint64 mHighWaterBytes;
+    qint64 mLowWaterBytes;
+    qint64 mPendingBytes {0};
+    qint32 mRecoveredRecords {0};
+    //replay of the records left by the previous run, reported once they are all confirmed
+    qint32 mReplayRecords {0};
+    qint32 mReplayRemaining {0};
+    QElapsedTimer mReplayClock;
+    bool mBackpressure {false};
+    void appendToOutbox(const OutputBinaryMessage& message, QByteArray&& value);
+    void updateBackpressure();
+
+    //send window. Groups taken from the persistent queue stay in mGroups until all
+    //their records are sent. Outbox::confirm is applied in the order of mGroups
+    qint32 mMaxInFlight;
+    bool mRunning {false};
+    quint64 mLastSequence {0};
+    quint64 mLastGroup {0};
+    qint32 mPulledRecords {0};
+    QMap<quint64, Group> mGroups;     //outbox group -> record counters
+    QMap<quint64, Batch> mBatches;    //batch sequence -> batch
+    QHash<qint64, quint64> mInFlight; //http request id -> batch sequence
+
+    //batching. Consecutive records of the same lane are packed into one request
+    qint32 mBatchMaxRecords;
+    qint64 mBatchMaxBytes;
+    qint32 mLingerMs;
+    //with adaptiveBatching mBatchMaxRecords and mMaxInFlight follow the controller
+    std::unique_ptr<BatchController> mController;
+    qint64 mLastLatencyMs {-1};
+    QTimer mWakeup;
+    QElapsedTimer mClock;
+
+    //a failed batch is sent again after an exponential backoff with jitter
+    qint32 mRetryBackoffMs;
+    qint32 mRetryBackoffMaxMs;
+    std::unique_ptr<CircuitBreaker> mBreaker;
+
+    //rate limits, checked before a batch is sent. A topic without its own limit only
+    //counts against the global one
+    RateLimit mGlobalRate;
+    QHash<QString, RateLimit> mTopicRates;
+    static RateLimit rateLimit(QSettings& settings, const QString& prefix);
+    qint64 throttleMs(const Batch& batch);
+    void takeRate(const Batch& batch);
+
+    //lanes. Records are spread by topic (or by topic and key), so a slow topic does not hold
+    //the others back. A lane may have several batches in flight, but a key is only in one of
+    //them, which keeps the order of every key across retries. The lanes share the in-flight
+    //window in round-robin order
+    bool mLaneByKey;
+    qint32 mReadAhead;
+    qint32 mStagedRecords {0};
+    QMap<QString, Lane> mLanes;
+    qint32 readAheadUsed() const;
+    QString mLastLane;
+
+    //compaction. For topics listed in compactTopics only the latest staged value of a key
+    //is sent, older ones are dropped before they are packed into a batch
+    QSet<QString> mCompactTopics;
+    quint64 mCompacted {0};
+    qint32 compact(Lane& lane);
+
+    QString laneOf(const OutputBinaryMessage& message) const;
+    QStringList laneOrder() const;
+    static qint64 encodedSize(const OutputBinaryMessage& message);
+    void stage();
+    bool takeBatch(Lane& lane, Batch& batch);
+    qint64 retryDelay(qint32 failures) const;
+    void scheduleWakeup();
+    void pump();
+    void dispatch(quint64 sequence);
+    void confirmCompleted();
 private slots:
     void onRequestClusterId();
-    void onRequestSchema();
-    void onSchemaReadingFailed(const QString& reason);
-    void onSchemaReceived(QList<SchemaRegistry::Schema> schemas);
-
-    void onSend();
-    void onSendFailed();
-    void onSendConfirmed();
-    void onWaitForData();
+    void onSubjectSchemaId(QString subject, qint32 schemaId);
+    void onSubjectRejected(QString subject, qint32 httpStatus);
+    void onLatestSchema(SchemaRegistry::Schema schema);
+    void onSchemaRefresh();
+
+    void onRunning();
+    void onBatchSent(qint64 requestId, qint64 latencyMs);
+    void onBatchFailed(qint64 requestId, QString message, qint64 latencyMs);
 public:
     KafkaProtobufProducer(bool verbose);
     static QByteArray addSchemaRegistryId(qint32 schemaId, const QByteArray& data);
     void send(OutputBinaryMessage message);
+    //append all messages to the outbox and wake the send pipeline once
+    void send(QList<OutputBinaryMessage>&& messages);
+    void send(QSpan<const OutputBinaryMessage> messages);
+    //thread safe. Returns false when the message was not queued (IngressPolicy::Fail on a full ring).
+    //Must not be called from the producer thread with IngressPolicy::Block
+    bool post(OutputBinaryMessage message);
+    quint64 ingressDropped() const {return mIngressDropped;}
+    qint32 pendingCount() const;
+    quint64 compactedCount() const {return mCompacted;}
+    qint64 pendingBytes() const {return mPendingBytes;}
+    bool backpressure() const {return mBackpressure;}
+    //current operating point of the send pipeline
+    qint32 batchRecords() const {return mBatchMaxRecords;}
+    qint32 inFlightLimit() const {return mMaxInFlight;}
+    qint64 latencyMs() const {return mController ? mController->latencyMs() : mLastLatencyMs;}
     void stop();
 signals:
-    void schemaReady();
     void newData();
     void error();
 
     void messageSent();
     void failed(QString message);
+    void circuitStateChanged(CircuitBreaker::State state);
+    void schemaIdChanged(QString topic, qint32 schemaId);
+    void operatingPointChanged(qint32 batchRecords, qint32 maxInFlight, qint64 latencyMs);
+    void backpressureOn();
+    void backpressureOff();
 };
 
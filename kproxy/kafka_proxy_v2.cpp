@@ -1,6 +1,9 @@
 #include "kafka_proxy_v2.h"
 #include "http_client.h"
 #include "kafka_messages.h"
+#include "base64.h"
+#include "record_stream_parser.h"
+#include "wire_format.h"
 #include <qjsondocument.h>
 #include <qsslerror.h>
 #include <qstringview.h>
@@ -18,8 +21,8 @@ void KafkaProxyV2::initialize(QString groupName) {
     auto url = QString("consumers/%1").arg(mGroupName);
     auto json = QJsonObject {
         {"format", mMediaType},
-        {"fetch.min.bytes", 1}, //when at least 1 byte is available - report it immediately, don't wait the timeout
-        {"consumer.request.timeout.ms", 10000},
+        {"fetch.min.bytes", mFetch.minBytes}, //1: report the data immediately, don't wait the timeout
+        {"consumer.request.timeout.ms", mFetch.requestTimeoutMs},
         {"auto.offset.reset", "earliest"},
         {"auto.commit.enable", false} //explicitly set which messages are processed
     };
@@ -125,22 +128,88 @@ void KafkaProxyV2::stopReading() {
 }
 
 
+void KafkaProxyV2::setFetchOptions(const FetchOptions& options) {
+    mFetch = options;
+    if (mFetch.adaptive) {
+        mFetch.adaptiveMaxBytes = qMax(mFetch.adaptiveMinBytes, mFetch.adaptiveMaxBytes);
+        mFetch.maxBytes = qBound(mFetch.adaptiveMinBytes, mFetch.maxBytes, mFetch.adaptiveMaxBytes);
+    }
+}
+
+
+void KafkaProxyV2::adaptFetchSize(qint64 replyBytes) {
+    //a full reply means the consumer lags behind, a nearly empty one that it caught up
+    auto maxBytes = mFetch.maxBytes;
+    if (replyBytes >= maxBytes * 9 / 10) {
+        maxBytes = qMin(maxBytes * 2, mFetch.adaptiveMaxBytes);
+    } else if (replyBytes < maxBytes / 8) {
+        maxBytes = qMax(maxBytes / 2, mFetch.adaptiveMinBytes);
+    }
+
+    if (maxBytes != mFetch.maxBytes) {
+        debugLog(QString("fetch max_bytes %1 -> %2, reply %3 bytes").arg(mFetch.maxBytes).arg(maxBytes).arg(replyBytes));
+        mFetch.maxBytes = maxBytes;
+    }
+}
+
+
 void KafkaProxyV2::getRecords() {
     auto url = QString("consumers/%1/instances/%2/records").arg(mGroupName).arg(mInstanceId);
+    QStringList query;
+    if (mFetch.maxBytes > 0) {
+        query << QString("max_bytes=%1").arg(mFetch.maxBytes);
+    }
+    if (mFetch.timeoutMs >= 0) {
+        query << QString("timeout=%1").arg(mFetch.timeoutMs);
+    }
+    if (!query.isEmpty()) {
+        url += "?" + query.join("&");
+    }
     debugLog(QString("getRecords: %1").arg(url));
-    mPendingRead = mRest.get(requestV2(url,mMediaType), this, [this](QRestReply& reply){
+
+    //the records are delivered while the reply arrives, only the record being read is buffered
+    using Offsets = QMap<QPair<QString, qint32>, qint64>;
+    auto offsets = std::make_shared<Offsets>();
+    auto parser = std::make_shared<RecordStreamParser>([this, offsets](const QByteArray& element) {
+        auto obj = QJsonDocument::fromJson(element).object();
+        if (mMediaType == kMediaProtobuf) {
+            reportInputJson(obj);
+        } else if (mMediaType == kMediaBinary) {
+            reportInputBinary(obj);
+        } else {
+            qWarning() << "invalid media type";
+            return;
+        }
+
+        //a record which failed validation counts as delivered too, it would block the partition
+        auto topic = obj["topic"].toString();
+        auto partition = obj["partition"].toInt();
+        auto offset = obj["offset"].toInteger();
+        mOffsets.delivered(topic, partition, offset);
+        if (mVerbose) {
+            (*offsets)[{topic, partition}] = offset; //keep the last offset from a partition
+        }
+    });
+
+    auto networkReply = mRest.get(requestV2(url,mMediaType), this, [this, parser, offsets](QRestReply& reply){
         debugLog("getRecords received data");
-        if (!mPendingRead->isReadable()) {
-            debugLog("socket not readable");
+        auto networkReply = reply.networkReply();
+        if (mPendingRead == networkReply) {
             mPendingRead = nullptr;
+        }
+        if (networkReply->error() == QNetworkReply::OperationCanceledError || !networkReply->isReadable()) {
+            debugLog("socket not readable");
             return;
         }
-        auto json = reply.readJson();
-        if (!json || !json->isArray()) {
+        parser->feed(networkReply->readAll());
+        if (!parser->finished()) {
             QString error = QString("Read error. ");
-            if (json->isObject()) {
-                auto obj = json->object();
-                error += obj["message"].toString();
+            auto json = QJsonDocument::fromJson(parser->object());
+            if (json.isObject()) {
+                error += json.object()["message"].toString();
+            }
+            if (parser->count() > 0) {
+                error += QString(" after %1 records").arg(parser->count());
             }
             debugLog(error);
             qWarning() << "KafkaProxyV2 reading error" << error;
@@ -148,37 +217,27 @@ void KafkaProxyV2::getRecords() {
             return;
         }
 
-        QMap<QString, qint32> offsets;
-        for (const auto& item: json->array()) {
-            auto obj = item.toObject();
-            if (mMediaType == kMediaProtobuf) {
-                reportInputJson(obj);
-            } else if (mMediaType == kMediaBinary) {
-                reportInputBinary(obj);
-            } else {
-                qWarning() << "invalid media type";
-                continue;
-            }
-
-            if (mVerbose) {
-                auto offset = obj["offset"].toInt();
-                auto topic = obj["topic"].toString();
-                offsets[topic] = offset; //keep the last offset from a topic
-            }
-        } 
+        if (mFetch.adaptive) {
+            adaptFetchSize(parser->bytes());
+        }
         if (mVerbose) {
-            for (const auto& topic: offsets.keys()) {
-                debugLog(QString("received offset %1 from topic %2").arg(offsets[topic]).arg(topic));
+            for (auto it = offsets->constBegin(); it != offsets->constEnd(); ++it) {
+                debugLog(QString("received offset %1 from topic %2 partition %3").arg(it.value()).arg(it.key().first).arg(it.key().second));
             }
         }
+        emit recordsFetched(parser->count());
         emit readingComplete();
     });
+    connect(networkReply, &QNetworkReply::readyRead, this, [parser, networkReply]() {
+        parser->feed(networkReply->readAll());
+    });
+    mPendingRead = networkReply;
 }
 
 void KafkaProxyV2::reportInputJson(const QJsonObject& obj) {
     InputMessage<QJsonDocument> input;
     input.key = obj["key"].toString();
-    input.offset = obj["offset"].toInt();
+    input.offset = obj["offset"].toInteger();
     input.partition = obj["partition"].toInt();
     input.topic = obj["topic"].toString();
     input.value = QJsonDocument{obj["value"].toObject()};
@@ -188,13 +247,13 @@ void KafkaProxyV2::reportInputJson(const QJsonObject& obj) {
 void KafkaProxyV2::reportInputBinary(const QJsonObject& obj) {
     InputMessage<QByteArray> input;
     input.key = obj["key"].toString();
-    input.offset = obj["offset"].toInt();
+    input.offset = obj["offset"].toInteger();
     input.partition = obj["partition"].toInt();
     input.topic = obj["topic"].toString();
-    auto value = QByteArray::fromBase64(obj["value"].toString().toUtf8());
+    auto value = Base64::fromBase64(obj["value"].toString().toLatin1());
 
-    auto key = obj["key"].toString().toUtf8();
-    input.key = QByteArray::fromBase64(key);
+    auto key = obj["key"].toString().toLatin1();
+    input.key = Base64::fromBase64(key);
 
     qint32 schemaId;
     if (isValid(value, schemaId)) {
@@ -237,11 +296,56 @@ void KafkaProxyV2::commitAllOffsets() {
 }
 
 
-void KafkaProxyV2::commitOffset(QString topic, qint32 offset) {
+void KafkaProxyV2::commitDeliveredOffsets() {
+    if (mCommitInFlight) {
+        mCommitAgain = true;
+    } else {
+        postOffsets();
+    }
+}
+
+
+void KafkaProxyV2::postOffsets() {
+    auto offsets = mOffsets.pending();
+    if (offsets.isEmpty()) return;
+
+    //the proxy commits offset + 1, the position after the last delivered record
+    QJsonArray array;
+    for (auto it = offsets.constBegin(); it != offsets.constEnd(); ++it) {
+        array << QJsonObject {
+            {"topic", it.key().topic},
+            {"partition", it.key().partition},
+            {"offset", it.value()}
+        };
+    }
+    mCommitInFlight = true;
+    mCommitAgain = false;
+
+    auto url = QString("consumers/%1/instances/%2/offsets").arg(mGroupName).arg(mInstanceId);
+    mRest.post(requestV2(url), QJsonDocument{QJsonObject{{"offsets", array}}}, this, [this, offsets](QRestReply &reply) {
+        mCommitInFlight = false;
+        if (!reply.isHttpStatusSuccess()) {
+            //the offsets stay pending and go with the next commit
+            mCommitAgain = false;
+            debugLog(QString("offset commit failed, error %1").arg(reply.httpStatus()));
+            emit offsetCommitFailed();
+            return;
+        }
+        mOffsets.committed(offsets);
+        debugLog(QString("committed offsets of %1 partitions").arg(offsets.size()));
+        emit offsetCommitted();
+        if (mCommitAgain) {
+            postOffsets();
+        }
+    });
+}
+
+
+void KafkaProxyV2::commitOffset(QString topic, qint64 offset, qint32 partition) {
     auto array = QJsonArray{
         QJsonObject {
             {"topic", topic},
-            {"partition", 0}, //todo - add partition as parameter
+            {"partition", partition},
             {"offset", offset}
         }
     };
@@ -250,23 +354,24 @@ void KafkaProxyV2::commitOffset(QString topic, qint32 offset) {
     };
 
     auto url = QString("consumers/%1/instances/%2/offsets").arg(mGroupName).arg(mInstanceId);
-    mRest.post(requestV2(url), QJsonDocument{json}, this, [this, offset, topic](QRestReply &reply) {
+    mRest.post(requestV2(url), QJsonDocument{json}, this, [this, offset, topic, partition](QRestReply &reply) {
         if (!reply.isHttpStatusSuccess()) {
             emit failed(QString("error %1").arg(reply.httpStatus()));
         } else {
-            debugLog(QString("committed offset %1 for topic %2").arg(offset).arg(topic));
+            mOffsets.committed({{{topic, partition}, offset}});
+            debugLog(QString("committed offset %1 for topic %2 partition %3").arg(offset).arg(topic).arg(partition));
             emit offsetCommitted();
         }
     });
 }
 
 
-void KafkaProxyV2::getOffset(const QString& group, const QString& topic) {
+void KafkaProxyV2::getOffset(const QString& group, const QString& topic, qint32 partition) {
     auto url = QString("consumers/%1/instances/%2/offsets").arg(mGroupName).arg(mInstanceId);
     auto array = QJsonArray{
         QJsonObject {
             {"topic", topic},
-            {"partition", 0}
+            {"partition", partition}
         }
     };
     auto json = QJsonObject {
@@ -283,26 +388,62 @@ void KafkaProxyV2::sendJson(const QString& key, const QString& topic, const QJso
     qCritical() << "send json not implemented in KafkaProxyV2";
 }
 
-void KafkaProxyV2::sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& data) {
-    QJsonArray records;
+qint64 KafkaProxyV2::sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& data) {
+    QList<OutputBinaryMessage> records;
     for (const auto& item: data) {
-        QJsonObject record;
-        if (!key.isEmpty()) { //there is no option to send the value in binary (base64) and leave the key as string
-            auto base64Key = key.toUtf8().toBase64(); 
-            record["key"] = QString(base64Key);
+        records << OutputBinaryMessage{key, topic, item};
+    }
+    return sendRecords(topic, records);
+}
+
+
+QByteArray KafkaProxyV2::recordsBody(const QList<OutputBinaryMessage>& data, qint32 schemaId) {
+    //{"records":[{"key":"<base64>","value":"<base64>"},...]} written directly, base64 needs no escaping.
+    //The same compact JSON QJsonDocument produced, without the intermediate objects
+    constexpr char kHead[] = R"({"records":[)";
+    constexpr char kTail[] = "]}";
+    constexpr char kKey[] = R"({"key":")";
+    constexpr char kKeyValue[] = R"(","value":")";
+    constexpr char kValue[] = R"({"value":")";
+    constexpr char kRecordEnd[] = R"("})";
+
+    QList<QByteArray> keys;
+    qsizetype size = sizeof(kHead) + sizeof(kTail);
+    for (const auto& item: data) {
+        //there is no option to send the value in binary (base64) and leave the key as string
+        keys << item.key.toUtf8();
+        size += sizeof(kKeyValue) + sizeof(kRecordEnd) + Base64::encodedSize(keys.last().size()) +
+            Base64::encodedSize(item.value.size() + WireFormat::kHeaderSize);
+    }
+
+    QByteArray body;
+    body.reserve(size);
+    body += kHead;
+    for (qsizetype i = 0; i < data.size(); i++) {
+        if (i) body += ',';
+        if (keys[i].isEmpty()) {
+            body += kValue;
+        } else {
+            body += kKey;
+            WireFormat::appendBase64(body, -1, keys[i]);
+            body += kKeyValue;
         }
-        record["value"] = QString(item.toBase64());
-        records << record;
+        WireFormat::appendBase64(body, schemaId, data[i].value);
+        body += kRecordEnd;
     }
+    body += kTail;
+    return body;
+}
 
-    auto payload = QJsonObject {
-        {"records", records} 
-    };
 
-    debugLog(QString("send %1 messages").arg(records.size()));
+qint64 KafkaProxyV2::sendRecords(const QString& topic, const QList<OutputBinaryMessage>& data, qint32 schemaId) {
+    auto requestId = nextRequestId();
+    auto body = recordsBody(data, schemaId);
+
+    debugLog(QString("send %1 messages, %2 bytes, request %3").arg(data.size()).arg(body.size()).arg(requestId));
     auto url = QString("topics/%1").arg(topic);
-    mRest.post(requestV2(url, kMediaBinary), QJsonDocument{payload}, this,
-               [this](QRestReply &reply) {
+    postBody(requestV2(url, kMediaBinary), body,
+               [this, requestId](QRestReply &reply) {
                    bool success = false;
                    auto json = reply.readJson();
                    if (json && json->isObject()) {
@@ -314,11 +455,14 @@ void KafkaProxyV2::sendBinary(const QString& key, const QString& topic, const QL
 
                    if (success) {
                        emit messageSent();
+                       emit batchSent(requestId, takeLatency(requestId));
                    } else {
                        emit failed("failed to send the message");
+                       emit batchFailed(requestId, "failed to send the message", takeLatency(requestId));
                    }
                        
                });
+    return requestId;
 }    
 
 
@@ -3,19 +3,43 @@
 #include <qjsondocument.h>
 #include <qstringview.h>
 #include "kafka_messages.h"
+#include "offset_tracker.h"
 #include <QElapsedTimer>
 
 
 class KafkaProxyV2 : public HttpClient {
     Q_OBJECT
+public:
+    struct FetchOptions {
+        qint64 maxBytes {0};            //max_bytes of a fetch, 0 leaves it to the proxy
+        qint32 timeoutMs {-1};          //timeout of a fetch, -1 leaves it to the proxy
+        qint32 minBytes {1};            //fetch.min.bytes of the consumer instance
+        qint32 requestTimeoutMs {10000}; //consumer.request.timeout.ms of the consumer instance
+        //doubles maxBytes while fetches come back full, halves it while they are nearly empty
+        bool adaptive {false};
+        qint64 adaptiveMinBytes {64 * 1024};
+        qint64 adaptiveMaxBytes {64 * 1024 * 1024};
+    };
+
+private:
+    FetchOptions mFetch;
+    void adaptFetchSize(qint64 replyBytes);
     QString mInstanceId;
     QString mGroupName;
     QString mMediaType;
     QNetworkReply* mPendingRead {nullptr};
 
+    //delivered and committed offset of every (topic, partition). Only one commit is in
+    //flight, offsets delivered meanwhile are sent after it
+    OffsetTracker mOffsets;
+    bool mCommitInFlight {false};
+    bool mCommitAgain {false};
+    void postOffsets();
+
     void reportInputJson(const QJsonObject& obj);
     void reportInputBinary(const QJsonObject& obj);
     bool isValid(const QByteArray& data, qint32& schemaId);
+    static QByteArray recordsBody(const QList<OutputBinaryMessage>& data, qint32 schemaId);
 public:
 
     QString instanceId() const {return mInstanceId;}
@@ -25,23 +49,35 @@ public:
     KafkaProxyV2(QString server, QString user, QString password, bool verbose, QString mediaType = "");
     void initialize(QString groupName) override;
     void subscribe(const QStringList& topic);
+    void setFetchOptions(const FetchOptions& options);
+    qint64 fetchMaxBytes() const {return mFetch.maxBytes;}
     void getRecords();
     void stopReading();
 
-    void commitOffset(QString topic, qint32 offset);
+    void commitOffset(QString topic, qint64 offset, qint32 partition = 0);
     void commitAllOffsets();
-    void getOffset(const QString& group, const QString& topic);
+    //commits only the records delivered so far, safe while the next fetch is running
+    void commitDeliveredOffsets();
+    bool commitsPending() const {return mCommitInFlight || mOffsets.hasPending();}
+    const OffsetTracker& offsets() const {return mOffsets;}
+    void getOffset(const QString& group, const QString& topic, qint32 partition = 0);
 
-    void sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& data) override;
+    qint64 sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& data) override;
+    //the values are framed with schemaId while they are encoded. -1 sends them as they are
+    qint64 sendRecords(const QString& topic, const QList<OutputBinaryMessage>& records, qint32 schemaId = -1);
     void sendJson(const QString& key, const QString& topic, const QJsonDocument& json) override;
 signals:
     void subscribed(QString topics);
     void finished(QString message);
     void receivedJson(InputMessage<QJsonDocument> message);
     void receivedBinary(qint32 schemaId, InputMessage<QByteArray> message);
+    //emitted when a fetch reply is complete with the number of records it delivered. The
+    //records are delivered while the reply arrives
+    void recordsFetched(qint32 count);
     void readingComplete();
     void readingError();
     void oldInstanceDeleted(QString message);
 
     void offsetCommitted();
+    void offsetCommitFailed();
 };
@@ -1,4 +1,5 @@
 #include "kafka_proxy_v3.h"
+#include "base64.h"
 #include <qjsondocument.h>
 
 KafkaProxyV3::KafkaProxyV3(QString server, QString user, QString password, bool verbose) : HttpClient(server, user, password, verbose) {
@@ -175,11 +176,12 @@ void KafkaProxyV3::sendJson(const QString& key, const QString& topic, const QJso
     });
 }
 
-void KafkaProxyV3::sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& list) {
+qint64 KafkaProxyV3::sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& list) {
     if (list.size() != 1) {
         qWarning() << "KafkaProxyV3 can send only 1 record";
-        return;
+        return -1;
     }
+    auto requestId = nextRequestId();
     auto binary = list.first();
     auto url = QString("v3/clusters/%1/topics/%2/records").arg(mClusterID).arg(topic);
     QJsonObject payload;
@@ -192,13 +194,14 @@ void KafkaProxyV3::sendBinary(const QString& key, const QString& topic, const QL
 
     payload["value"] = QJsonObject {
         {"type", "BINARY"},
-        {"data", (QString)binary.toBase64()}
+        {"data", QString::fromLatin1(Base64::toBase64(binary))}
     };
 
-    mRest.post(requestV3(url), QJsonDocument(payload), this, [this](QRestReply &reply) {
+    mRest.post(requestV3(url), QJsonDocument(payload), this, [this, requestId](QRestReply &reply) {
         auto data = reply.readJson();
         if (!data || !data->isObject()) {
             emit failed("Unkown error");
+            emit batchFailed(requestId, "Unkown error", takeLatency(requestId));
             return;
         }
 
@@ -206,11 +209,14 @@ void KafkaProxyV3::sendBinary(const QString& key, const QString& topic, const QL
         auto errorCode = obj["error_code"].toInt();
         if (errorCode == 200) {
             emit messageSent();
+            emit batchSent(requestId, takeLatency(requestId));
         } else {
             auto errorMsg = obj["message"].toString();
             emit failed(errorMsg);
+            emit batchFailed(requestId, errorMsg, takeLatency(requestId));
         }
     });
+    return requestId;
 }
 
 
@@ -258,9 +264,9 @@ void KafkaProxyV3::getGroupLag(const QString& group) {
                     obj["consumer_group_id"].toString(),
                     obj["consumer_id"].toString(),
                     obj["topic_name"].toString(),
-                    obj["current_offset"].toInt(),
-                    obj["log_end_offset"].toInt(),
-                    obj["lag"].toInt()
+                    obj["current_offset"].toInteger(),
+                    obj["log_end_offset"].toInteger(),
+                    obj["lag"].toInteger()
                 });
         }
         emit groupLags(result);
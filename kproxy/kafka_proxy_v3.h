@@ -41,9 +41,9 @@ public:
         QString groupName;
         QString consumerId;
         QString topic;
-        qint32 currentOffset;
-        qint32 endOffset;
-        qint32 lag;
+        qint64 currentOffset;
+        qint64 endOffset;
+        qint64 lag;
     };
 
     struct GroupLagSummary {
@@ -66,7 +66,7 @@ public:
     void deleteTopic(const QString& topic);
 
     void sendJson(const QString& key, const QString& topic, const QJsonDocument& json) override;
-    void sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& binary) override;
+    qint64 sendBinary(const QString& key, const QString& topic, const QList<QByteArray>& binary) override;
     void getGroupConsumers(const QString& group);
     void getGroupLag(const QString& group);
     void getGroupLagSummary(const QString& group);
@@ -0,0 +1,43 @@
+#include "offset_tracker.h"
+
+void OffsetTracker::delivered(const QString& topic, qint32 partition, qint64 offset) {
+    auto& offsets = mOffsets[{topic, partition}];
+    offsets.delivered = qMax(offsets.delivered, offset);
+}
+
+
+void OffsetTracker::committed(const QHash<Partition, qint64>& offsets) {
+    for (auto it = offsets.constBegin(); it != offsets.constEnd(); ++it) {
+        auto& tracked = mOffsets[it.key()];
+        tracked.committed = qMax(tracked.committed, it.value());
+    }
+}
+
+
+QHash<OffsetTracker::Partition, qint64> OffsetTracker::pending() const {
+    QHash<Partition, qint64> result;
+    for (auto it = mOffsets.constBegin(); it != mOffsets.constEnd(); ++it) {
+        if (it->delivered > it->committed) {
+            result.insert(it.key(), it->delivered);
+        }
+    }
+    return result;
+}
+
+
+bool OffsetTracker::hasPending() const {
+    for (const auto& offsets: mOffsets) {
+        if (offsets.delivered > offsets.committed) return true;
+    }
+    return false;
+}
+
+
+qint64 OffsetTracker::deliveredOffset(const QString& topic, qint32 partition) const {
+    return mOffsets.value({topic, partition}).delivered;
+}
+
+
+qint64 OffsetTracker::committedOffset(const QString& topic, qint32 partition) const {
+    return mOffsets.value({topic, partition}).committed;
+}
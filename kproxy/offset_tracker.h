@@ -0,0 +1,38 @@
+#pragma once
+#include <QtCore>
+
+//Offsets of every (topic, partition) read by a consumer: the last delivered record and the
+//last committed one. pending() lists the partitions delivered past their committed offset
+class OffsetTracker {
+public:
+    struct Partition {
+        QString topic;
+        qint32 partition;
+
+        bool operator==(const Partition& other) const {return partition == other.partition && topic == other.topic;}
+    };
+
+    struct Offsets {
+        qint64 delivered {-1};
+        qint64 committed {-1};
+    };
+
+private:
+    QHash<Partition, Offsets> mOffsets;
+
+public:
+    void delivered(const QString& topic, qint32 partition, qint64 offset);
+    void committed(const QHash<Partition, qint64>& offsets);
+
+    QHash<Partition, qint64> pending() const;
+    bool hasPending() const;
+
+    //-1 when nothing was delivered or committed from the partition
+    qint64 deliveredOffset(const QString& topic, qint32 partition) const;
+    qint64 committedOffset(const QString& topic, qint32 partition) const;
+    QHash<Partition, Offsets> offsets() const {return mOffsets;}
+};
+
+inline size_t qHash(const OffsetTracker::Partition& key, size_t seed = 0) {
+    return qHashMulti(seed, key.topic, key.partition);
+}
@@ -0,0 +1,40 @@
+#include "outbox.h"
+#include <pqueue/pqueue.h>
+
+
+PQueueOutbox::PQueueOutbox(const QString& fileName, qint32 limit, qint32 timeToSave) :
+    mQueue(new PQueue(fileName, limit, timeToSave)) {
+}
+
+
+PQueueOutbox::~PQueueOutbox() = default;
+
+
+bool PQueueOutbox::append(const QString& topic, const QString& key, QByteArray payload) {
+    //pqueue does not report a record it refuses, a full queue keeps its size
+    auto size = mQueue->size();
+    mQueue->append(topic, key, std::move(payload));
+    return mQueue->size() > size;
+}
+
+
+qint32 PQueueOutbox::size() const {
+    return mQueue->size();
+}
+
+
+QList<Outbox::Item> PQueueOutbox::next() {
+    auto group = mQueue->next();
+
+    QList<Item> items;
+    items.reserve(group.size());
+    for (const auto& item: group) {
+        items << Item{item.topic, item.key, item.payload};
+    }
+    return items;
+}
+
+
+void PQueueOutbox::confirm() {
+    mQueue->confirm();
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <QtCore>
+
+//Persistent queue of records waiting to be produced. Records are taken in groups with next()
+//and stay in the outbox until confirm() releases the oldest group taken
+class Outbox {
+public:
+    struct Item {
+        QString topic;
+        QString key;
+        QByteArray payload;
+    };
+
+    virtual ~Outbox() = default;
+
+    //false when the record was dropped, e.g. because the outbox is full
+    virtual bool append(const QString& topic, const QString& key, QByteArray payload) = 0;
+    //records not confirmed yet, including the ones taken with next()
+    virtual qint32 size() const = 0;
+    virtual QList<Item> next() = 0;
+    virtual void confirm() = 0;
+};
+
+class PQueue;
+
+//outbox kept by the pqueue package, saved every timeToSave ms
+class PQueueOutbox : public Outbox {
+    std::unique_ptr<PQueue> mQueue;
+public:
+    PQueueOutbox(const QString& fileName, qint32 limit, qint32 timeToSave);
+    ~PQueueOutbox() override;
+
+    bool append(const QString& topic, const QString& key, QByteArray payload) override;
+    qint32 size() const override;
+    QList<Item> next() override;
+    void confirm() override;
+};
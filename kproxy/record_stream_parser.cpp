@@ -0,0 +1,114 @@
+#include "record_stream_parser.h"
+
+namespace {
+    constexpr qsizetype kMaxObjectSize = 1024 * 1024;
+
+    bool isSpace(char c) {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+}
+
+
+RecordStreamParser::RecordStreamParser(std::function<void(const QByteArray&)> onElement) :
+    mOnElement(std::move(onElement))
+{
+}
+
+
+bool RecordStreamParser::scan(char c) {
+    //true when c closes the element
+    if (mInString) {
+        if (mEscape) {
+            mEscape = false;
+        } else if (c == '\\') {
+            mEscape = true;
+        } else if (c == '"') {
+            mInString = false;
+        }
+        return false;
+    }
+
+    switch (c) {
+    case '"':
+        mInString = true;
+        break;
+    case '{':
+    case '[':
+        mDepth++;
+        break;
+    case '}':
+    case ']':
+        return --mDepth == 0;
+    }
+    return false;
+}
+
+
+void RecordStreamParser::feed(QByteArrayView data) {
+    mBytes += data.size();
+
+    //start of the part of data which belongs to the current element
+    qsizetype start = mState == State::Element || mState == State::Object ? 0 : -1;
+    for (qsizetype i = 0; i < data.size(); i++) {
+        auto c = data[i];
+        switch (mState) {
+        case State::Start:
+            if (isSpace(c)) continue;
+            if (c == '[') {
+                mArray = true;
+                mState = State::Array;
+            } else if (c == '{') {
+                mState = State::Object;
+                mDepth = 1;
+                start = i;
+            } else {
+                mState = State::Failed;
+            }
+            break;
+
+        case State::Array:
+            if (isSpace(c) || c == ',') continue;
+            if (c == ']') {
+                mState = State::Done;
+            } else if (c == '{') {
+                mState = State::Element;
+                mDepth = 1;
+                start = i;
+            } else {
+                mState = State::Failed;
+            }
+            break;
+
+        case State::Element:
+        case State::Object:
+            if (!scan(c)) continue;
+            mElement.append(data.sliced(start, i + 1 - start));
+            start = -1;
+            if (mState == State::Object) {
+                mState = State::Done;
+            } else {
+                mCount++;
+                mOnElement(mElement);
+                mElement.clear();
+                mState = State::Array;
+            }
+            break;
+
+        case State::Done:
+            if (!isSpace(c)) {
+                mState = State::Failed;
+            }
+            break;
+
+        case State::Failed:
+            return;
+        }
+    }
+
+    if (start >= 0) {
+        mElement.append(data.sliced(start));
+        if (mState == State::Object && mElement.size() > kMaxObjectSize) {
+            mState = State::Failed;
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <QtCore>
+#include <functional>
+
+//Splits the JSON array of a fetch reply into its elements while the bytes arrive. Every
+//complete element is passed to the callback, so a fetch is delivered record by record and
+//only the element being read is kept in memory. A top level object (an error reply of the
+//proxy) is kept whole and returned by object()
+class RecordStreamParser {
+public:
+    enum class State {Start, Array, Element, Object, Done, Failed};
+
+private:
+    std::function<void(const QByteArray&)> mOnElement;
+    State mState {State::Start};
+    QByteArray mElement;
+    qint32 mDepth {0};
+    bool mInString {false};
+    bool mEscape {false};
+    bool mArray {false};
+    qint64 mBytes {0};
+    qint32 mCount {0};
+
+    bool scan(char c);
+public:
+    explicit RecordStreamParser(std::function<void(const QByteArray&)> onElement);
+
+    void feed(QByteArrayView data);
+
+    State state() const {return mState;}
+    bool isArray() const {return mArray;}
+    //a complete array was read
+    bool finished() const {return mState == State::Done && mArray;}
+    qint64 bytes() const {return mBytes;}
+    qint32 count() const {return mCount;}
+    QByteArray object() const {return mArray ? QByteArray() : mElement;}
+};
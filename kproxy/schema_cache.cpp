@@ -0,0 +1,247 @@
+#include "schema_cache.h"
+#include <QSaveFile>
+#include <QtEndian>
+#include <string_view>
+
+namespace {
+    constexpr char kMagic[] = {'K', 'S', 'C', 'H'};
+    constexpr quint16 kFormatVersion = 1;
+    constexpr quint16 kFlagText = 1;
+    constexpr qint64 kHeaderSize = 16;
+    constexpr qint64 kEntrySize = 24;
+
+    template<typename T>
+    void put(QByteArray& out, T value) {
+        auto v = qToLittleEndian(value);
+        out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+}
+
+
+SchemaCache::SchemaCache(const QString& fileName, bool withText) : mFile(fileName), mWithText{withText} {
+    if (fileName.isEmpty() || !mFile.exists()) return;
+
+    if (!map()) {
+        importJson();
+    }
+}
+
+
+SchemaCache::~SchemaCache() {
+    unmap();
+}
+
+
+bool SchemaCache::map() {
+    if (!mFile.open(QIODevice::ReadOnly)) {
+        qWarning() << "Failed to open" << mFile.fileName();
+        return false;
+    }
+
+    auto size = mFile.size();
+    auto data = size >= kHeaderSize ? mFile.map(0, size) : nullptr;
+    if (!data) {
+        mFile.close();
+        return false;
+    }
+
+    auto count = qFromLittleEndian<quint32>(data + 8);
+    if (memcmp(data, kMagic, sizeof(kMagic)) != 0 ||
+        qFromLittleEndian<quint16>(data + 4) != kFormatVersion ||
+        kHeaderSize + qint64(count) * kEntrySize > size) {
+        mFile.unmap(data);
+        mFile.close();
+        return false;
+    }
+
+    mData = data;
+    mSize = size;
+    mCount = count;
+    return true;
+}
+
+
+void SchemaCache::unmap() {
+    if (mData) {
+        mFile.unmap(mData);
+        mData = nullptr;
+    }
+    mFile.close();
+    mSize = 0;
+    mCount = 0;
+}
+
+
+void SchemaCache::importJson() {
+    QFile f(mFile.fileName());
+    if (!f.open(QIODevice::ReadOnly)) return;
+
+    auto doc = QJsonDocument::fromJson(f.readAll());
+    if (!doc.isArray()) {
+        qWarning() << "Unknown schema cache format" << mFile.fileName();
+        return;
+    }
+
+    for (const auto& item: doc.array()) {
+        auto s = item.toObject();
+        SchemaRegistry::Schema schema;
+        schema.schemaId = s["schemaId"].toInt();
+        schema.schema = s["schema"].toString();
+        schema.schemaType = s["schemaType"].toString();
+        schema.subject = s["subject"].toString();
+        schema.version = s["version"].toInt();
+
+        for (const auto& ref: s["references"].toArray()) {
+            auto r = ref.toObject();
+            schema.references.append(SchemaRegistry::Reference{r["name"].toString(), r["subject"].toString(), r["version"].toInt()});
+        }
+
+        auto it = mUpdates.constFind(schema.subject);
+        if (it == mUpdates.constEnd() || it->version < schema.version) {
+            mUpdates[schema.subject] = schema; //keep only the latest version
+        }
+    }
+    qDebug() << "converting" << mFile.fileName() << "to the binary schema cache";
+    save();
+}
+
+
+QByteArrayView SchemaCache::bytes(quint32 offset, quint32 length) const {
+    if (qint64(offset) + length > mSize) return {};
+    return QByteArrayView(mData + offset, length);
+}
+
+
+QByteArrayView SchemaCache::subjectAt(quint32 index) const {
+    auto entry = mData + kHeaderSize + qint64(index) * kEntrySize;
+    return bytes(qFromLittleEndian<quint32>(entry), qFromLittleEndian<quint32>(entry + 4));
+}
+
+
+SchemaRegistry::Schema SchemaCache::schemaAt(quint32 index) const {
+    auto entry = mData + kHeaderSize + qint64(index) * kEntrySize;
+
+    SchemaRegistry::Schema schema;
+    schema.subject = QString::fromUtf8(subjectAt(index));
+    schema.schemaId = qFromLittleEndian<qint32>(entry + 8);
+    schema.version = qFromLittleEndian<qint32>(entry + 12);
+
+    auto details = bytes(qFromLittleEndian<quint32>(entry + 16), qFromLittleEndian<quint32>(entry + 20));
+    if (!details.isEmpty()) {
+        auto map = QCborValue::fromCbor(QByteArray::fromRawData(details.data(), details.size())).toMap();
+        schema.schema = map.value(QStringLiteral("schema")).toString();
+        schema.schemaType = map.value(QStringLiteral("schemaType")).toString();
+        for (const auto& item: map.value(QStringLiteral("references")).toArray()) {
+            auto r = item.toMap();
+            schema.references.append(SchemaRegistry::Reference{r.value(QStringLiteral("name")).toString(),
+                                      r.value(QStringLiteral("subject")).toString(),
+                                      qint32(r.value(QStringLiteral("version")).toInteger())});
+        }
+    }
+    return schema;
+}
+
+
+std::optional<SchemaRegistry::Schema> SchemaCache::find(const QString& subject) const {
+    auto it = mUpdates.constFind(subject);
+    if (it != mUpdates.constEnd()) return *it;
+
+    //binary search in the mapped index, only the found entry is decoded
+    auto key = subject.toUtf8();
+    auto wanted = std::string_view(key.constData(), key.size());
+    quint32 low = 0;
+    quint32 high = mCount;
+    while (low < high) {
+        auto middle = low + (high - low) / 2;
+        auto s = subjectAt(middle);
+        auto c = std::string_view(s.data(), s.size()).compare(wanted);
+        if (c == 0) return schemaAt(middle);
+        if (c < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return std::nullopt;
+}
+
+
+void SchemaCache::update(const SchemaRegistry::Schema& schema) {
+    mUpdates[schema.subject] = schema;
+    save();
+}
+
+
+bool SchemaCache::save() {
+    if (mFile.fileName().isEmpty()) return false;
+
+    //sorted by the utf8 bytes of the subject, the order used by find()
+    QMap<QByteArray, SchemaRegistry::Schema> entries;
+    for (quint32 i = 0; i < mCount; i++) {
+        auto schema = schemaAt(i);
+        entries[schema.subject.toUtf8()] = schema;
+    }
+    for (const auto& schema: mUpdates) {
+        entries[schema.subject.toUtf8()] = schema;
+    }
+
+    QByteArray subjects;
+    QByteArray details;
+    QList<std::array<quint32, 4>> ranges;
+    for (auto it = entries.constBegin(); it != entries.constEnd(); ++it) {
+        std::array<quint32, 4> range {quint32(subjects.size()), quint32(it.key().size()), quint32(details.size()), 0};
+        subjects += it.key();
+        if (mWithText) {
+            const auto& schema = it.value();
+            QCborArray references;
+            for (const auto& r: schema.references) {
+                references.append(QCborMap{{QStringLiteral("name"), r.name},
+                                           {QStringLiteral("subject"), r.subject},
+                                           {QStringLiteral("version"), r.version}});
+            }
+            auto cbor = QCborMap{{QStringLiteral("schema"), schema.schema},
+                                 {QStringLiteral("schemaType"), schema.schemaType},
+                                 {QStringLiteral("references"), references}}.toCborValue().toCbor();
+            range[3] = cbor.size();
+            details += cbor;
+        }
+        ranges << range;
+    }
+
+    auto subjectsStart = quint32(kHeaderSize + entries.size() * kEntrySize);
+    auto detailsStart = quint32(subjectsStart + subjects.size());
+
+    QByteArray out;
+    out.reserve(detailsStart + details.size());
+    out.append(kMagic, sizeof(kMagic));
+    put<quint16>(out, kFormatVersion);
+    put<quint16>(out, mWithText ? kFlagText : 0);
+    put<quint32>(out, entries.size());
+    put<quint32>(out, 0);
+
+    qint32 i = 0;
+    for (const auto& schema: entries) {
+        const auto& range = ranges[i++];
+        put<quint32>(out, subjectsStart + range[0]);
+        put<quint32>(out, range[1]);
+        put<qint32>(out, schema.schemaId);
+        put<qint32>(out, schema.version);
+        put<quint32>(out, range[3] ? detailsStart + range[2] : 0);
+        put<quint32>(out, range[3]);
+    }
+    out += subjects;
+    out += details;
+
+    //written to a temporary file and renamed, a crash leaves the old cache intact
+    QSaveFile f(mFile.fileName());
+    if (!f.open(QIODevice::WriteOnly) || f.write(out) != out.size() || !f.commit()) {
+        qWarning() << "Failed to write" << mFile.fileName();
+        return false;
+    }
+
+    unmap();
+    if (map()) {
+        mUpdates.clear();
+    }
+    return true;
+}
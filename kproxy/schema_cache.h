@@ -0,0 +1,33 @@
+#pragma once
+#include "schema_registry.h"
+#include <QtCore>
+
+//Local copy of the latest schema of every subject, used when the registry can not be reached.
+//The file is memory mapped and the entries are read on demand. Layout, little endian:
+//  header  "KSCH", u16 format version, u16 flags, u32 entry count, u32 reserved
+//  index   24 bytes per subject, sorted by subject: u32 subject offset, u32 subject length,
+//          i32 schema id, i32 version, u32 details offset, u32 details length
+//  data    utf8 subjects, then the optional CBOR encoded schema text, type and references
+//The file is replaced atomically with QSaveFile. A JSON file from older versions is imported
+class SchemaCache {
+    QFile mFile;
+    uchar* mData {nullptr};
+    qint64 mSize {0};
+    quint32 mCount {0};
+    bool mWithText;
+    QMap<QString, SchemaRegistry::Schema> mUpdates; //entries not written to the file yet
+
+    bool map();
+    void unmap();
+    void importJson();
+    QByteArrayView bytes(quint32 offset, quint32 length) const;
+    QByteArrayView subjectAt(quint32 index) const;
+    SchemaRegistry::Schema schemaAt(quint32 index) const;
+public:
+    SchemaCache(const QString& fileName, bool withText);
+    ~SchemaCache();
+
+    std::optional<SchemaRegistry::Schema> find(const QString& subject) const;
+    void update(const SchemaRegistry::Schema& schema);
+    bool save();
+};
@@ -45,47 +45,54 @@ void SchemaRegistry::getSchemas() {
         
         QList<Schema> report;
         for(const auto item: json->array()) {
-            auto schema = item.toObject();
-
-            auto result = Schema{
-                schema["id"].toInt(),
-                schema["schema"].toString(),
-                schema["schemaType"].toString(),
-                schema["subject"].toString(),
-                schema["version"].toInt()
-            };
-
-            if (schema.contains("references") && schema["references"].isArray()){
-                auto references = schema["references"].toArray();
-                for(const auto& reference: references) {
-                    auto obj = reference.toObject();
-                    Reference ref{
-                        obj["name"].toString(),
-                        obj["subject"].toString(),
-                        obj["version"].toInt()
-                    };
-                    result.references << ref;
-                }
-            }
-
-            
-            report.append(result);
+            report.append(fromJson(item.toObject()));
         }
         emit schemaList(report);
     });
 }
 
+SchemaRegistry::Schema SchemaRegistry::fromJson(const QJsonObject& schema) {
+    auto result = Schema{
+        schema["id"].toInt(),
+        schema["schema"].toString(),
+        schema["schemaType"].toString(),
+        schema["subject"].toString(),
+        schema["version"].toInt()
+    };
+
+    if (schema.contains("references") && schema["references"].isArray()){
+        auto references = schema["references"].toArray();
+        for(const auto& reference: references) {
+            auto obj = reference.toObject();
+            Reference ref{
+                obj["name"].toString(),
+                obj["subject"].toString(),
+                obj["version"].toInt()
+            };
+            result.references << ref;
+        }
+    }
+    return result;
+}
+
+
 void SchemaRegistry::getLatestSchemaId(const QString& subject) {
     QString url = "/subjects/" + subject + "/versions/-1";
     auto request = requestV3(url); //-1 is for the latest version
     mRest.get(request, this, [this,subject](QRestReply& reply){
         if (reply.error() != QNetworkReply::NoError) {
+            if (reply.httpStatus() >= 400 && reply.httpStatus() < 500) {
+                emit subjectRejected(subject, reply.httpStatus());
+            }
             emit subjectSchemaId(subject, -1);
         } else {
             auto schemaId = -1;
             if (auto json = reply.readJson(); json) {
                 auto obj = json->object();
                 schemaId =  obj.contains("id") ? obj["id"].toInt() : -1;
+                if (schemaId != -1) {
+                    emit latestSchema(fromJson(obj));
+                }
             }
             emit subjectSchemaId(subject, schemaId);
         }
@@ -38,8 +38,13 @@ signals:
     void schemaCreated(qint32 schemaId);
     void failed(QString message);
     void subjectSchemaId(QString subject, qint32 schemaId);
+    //the registry refused the lookup with a client error, e.g. 404 for an unknown subject.
+    //Emitted before subjectSchemaId(subject, -1), asking again will not help
+    void subjectRejected(QString subject, qint32 httpStatus);
+    void latestSchema(Schema schema);
     void schemaText(QString text);
 
 private:
+    static Schema fromJson(const QJsonObject& schema);
     QJsonDocument createSchemaJson(const QString& subject, const QByteArray& schema, const QString& schemaType, const QList<Schema>& references);
 };
@@ -0,0 +1,613 @@
+#include "segmented_outbox.h"
+#include <QSaveFile>
+#include <QThreadPool>
+#include <QtEndian>
+#include <zlib.h>
+#ifdef Q_OS_WIN
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    constexpr qint64 kRecordHeaderSize = 8;
+    constexpr qint64 kCursorSlotSize = 32;
+    constexpr qint64 kCursorSize = 2 * kCursorSlotSize;
+    constexpr char kSpareName[] = "spare.seg";
+    constexpr char kIndexMagic[] = {'K', 'O', 'B', 'X'};
+    constexpr quint16 kIndexVersion = 1;
+    constexpr qint64 kIndexHeaderSize = 16;
+    constexpr qint64 kIndexIntervalMs = 1000;
+
+    template<typename T>
+    void put(QByteArray& out, T value) {
+        auto v = qToLittleEndian(value);
+        out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    quint32 checksum(quint64 segment, const uchar* body, qint64 length) {
+        uchar seed[8];
+        qToLittleEndian<quint64>(segment, seed);
+        auto crc = crc32(0, seed, sizeof(seed));
+        return crc32(crc, body, uInt(length));
+    }
+
+    //hands the written pages to the kernel, without waiting for the disk
+    void flush(uchar* data, qint64 from, qint64 to) {
+#ifdef Q_OS_WIN
+        FlushViewOfFile(data + from, SIZE_T(to - from));
+#else
+        //msync wants a page aligned start
+        static const qint64 page = sysconf(_SC_PAGESIZE);
+        auto start = from / page * page;
+        msync(data + start, size_t(to - start), MS_ASYNC);
+#endif
+    }
+
+    //a descriptor of its own, the file may be closed by recycle() while a worker syncs it
+    int duplicate(const QFile& file) {
+#ifdef Q_OS_WIN
+        return _dup(file.handle());
+#else
+        return dup(file.handle());
+#endif
+    }
+
+    //waits until the files are on disk and closes them
+    void syncFiles(const QList<int>& files) {
+        for (auto fd: files) {
+            if (fd < 0) continue;
+#ifdef Q_OS_WIN
+            _commit(fd);
+            _close(fd);
+#else
+            fdatasync(fd);
+            close(fd);
+#endif
+        }
+    }
+
+    bool reserve(QFile& file, qint64 size) {
+        //a write through the mapping into a hole of a sparse file raises SIGBUS when the disk is full
+#ifdef Q_OS_WIN
+        return file.size() >= size || file.resize(size);
+#else
+        return posix_fallocate(file.handle(), 0, size) == 0;
+#endif
+    }
+}
+
+
+SegmentedOutbox::SegmentedOutbox(const QString& dir, qint32 limit, qint64 segmentBytes, qint32 syncMs, qint32 groupRecords) :
+    mDir(dir), mSegmentBytes{qMax(segmentBytes, 4096LL)}, mLimit{limit}, mGroupRecords{qMax(1, groupRecords)}, mSyncMs{syncMs} {
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!mDir.mkpath(".")) {
+        qWarning() << "Failed to create outbox directory" << dir;
+    }
+    openCursor();
+
+    //segments before the confirmed one hold only sent records
+    for (const auto& name: mDir.entryList({"*.seg"}, QDir::Files, QDir::Name)) {
+        if (name == kSpareName) continue;
+
+        bool ok;
+        auto number = QFileInfo(name).baseName().toULongLong(&ok, 16);
+        if (!ok) continue;
+        if (number < mConfirmed.segment) {
+            QFile::remove(mDir.filePath(name));
+            continue;
+        }
+
+        Segment segment;
+        segment.number = number;
+        segment.file = std::make_unique<QFile>(mDir.filePath(name));
+        if (!mapSegment(segment, 0)) {
+            qWarning() << "Failed to open outbox segment" << segment.file->fileName();
+            continue;
+        }
+        mSegments.push_back(std::move(segment));
+    }
+
+    if (!mSegments.empty() && mSegments.front().number > mConfirmed.segment) {
+        mConfirmed = {mSegments.front().number, 0};
+    }
+    recover();
+
+    if (mSegments.empty()) {
+        addSegment(0);
+    }
+    if (!mSegments.empty()) {
+        if (mConfirmed.segment == 0) {
+            mConfirmed = {mSegments.front().number, 0};
+        }
+        mSynced = {mSegments.back().number, mSegments.back().end};
+    }
+    mRead = mConfirmed;
+
+    mSyncTimer.setSingleShot(true);
+    QObject::connect(&mSyncTimer, &QTimer::timeout, &mSyncTimer, [this]() {sync(false);});
+    mIndexSaved.start();
+
+    mRecoveryMs = timer.elapsed();
+    qDebug() << "Outbox" << dir << "recovered" << mCount << "records in" << mSegments.size() << "segments in"
+             << mRecoveryMs << "ms," << (mRecoveredFromIndex ? "from the index" : "index not found, segments scanned");
+}
+
+
+SegmentedOutbox::~SegmentedOutbox() {
+    //the continuation of a running sync is dropped with the object, its records are synced again
+    mSyncDone.waitForFinished();
+    mSyncing = false;
+    sync(true);
+    saveIndex();
+    for (auto& segment: mSegments) {
+        segment.file->unmap(segment.data);
+    }
+    if (mCursor) {
+        mCursorFile.unmap(mCursor);
+    }
+}
+
+
+QString SegmentedOutbox::segmentName(quint64 number) const {
+    return mDir.filePath(QString("%1.seg").arg(number, 16, 16, QChar('0')));
+}
+
+
+SegmentedOutbox::Segment* SegmentedOutbox::segment(quint64 number) {
+    if (mSegments.empty() || number < mSegments.front().number) return nullptr;
+
+    auto index = number - mSegments.front().number;
+    return index < mSegments.size() ? &mSegments[index] : nullptr;
+}
+
+
+bool SegmentedOutbox::mapSegment(Segment& segment, qint64 size) {
+    auto& file = *segment.file;
+    if (!file.open(QIODevice::ReadWrite)) return false;
+    if (size > 0) {
+        if (!reserve(file, qMax(size, file.size()))) return false;
+        segment.reserved = true;
+    }
+
+    segment.size = file.size();
+    segment.data = segment.size > 0 ? file.map(0, segment.size) : nullptr;
+    return segment.data != nullptr;
+}
+
+
+SegmentedOutbox::Segment* SegmentedOutbox::addSegment(qint64 minSize) {
+    auto number = mSegments.empty() ? qMax<quint64>(mConfirmed.segment, 1) : mSegments.back().number + 1;
+    auto name = segmentName(number);
+
+    //a recycled segment keeps its old records, their checksums do not match the new number
+    auto spare = mDir.filePath(kSpareName);
+    if (QFile::exists(spare) && !QFile::exists(name)) {
+        QFile::rename(spare, name);
+    }
+
+    Segment segment;
+    segment.number = number;
+    segment.file = std::make_unique<QFile>(name);
+    if (!mapSegment(segment, qMax(mSegmentBytes, minSize))) {
+        qWarning() << "Failed to create outbox segment" << name;
+        return nullptr;
+    }
+    mSegments.push_back(std::move(segment));
+    return &mSegments.back();
+}
+
+
+void SegmentedOutbox::recycle() {
+    while (mSegments.size() > 1 && mSegments.front().number < mConfirmed.segment) {
+        auto& segment = mSegments.front();
+        auto name = segment.file->fileName();
+        segment.file->unmap(segment.data);
+        segment.file->close();
+
+        //one spare file is kept to avoid allocating the next segment
+        auto spare = mDir.filePath(kSpareName);
+        if (QFile::exists(spare) || !QFile::rename(name, spare)) {
+            QFile::remove(name);
+        }
+        mSegments.pop_front();
+    }
+}
+
+
+qint64 SegmentedOutbox::readRecord(const Segment& segment, qint64 offset, Item* item) const {
+    if (offset + kRecordHeaderSize > segment.size) return -1;
+
+    auto record = segment.data + offset;
+    auto length = qint64(qFromLittleEndian<quint32>(record));
+    if (length < 4 || length > segment.size - offset - kRecordHeaderSize) return -1;
+
+    auto body = record + kRecordHeaderSize;
+    if (checksum(segment.number, body, length) != qFromLittleEndian<quint32>(record + 4)) return -1;
+
+    auto topicLength = qFromLittleEndian<quint16>(body);
+    auto keyLength = qFromLittleEndian<quint16>(body + 2);
+    if (4 + topicLength + keyLength > length) return -1;
+
+    if (item) {
+        auto text = reinterpret_cast<const char*>(body + 4);
+        item->topic = QString::fromUtf8(text, topicLength);
+        item->key = QString::fromUtf8(text + topicLength, keyLength);
+        item->payload = QByteArray(text + topicLength + keyLength, length - 4 - topicLength - keyLength);
+    }
+    return offset + kRecordHeaderSize + length;
+}
+
+
+QString SegmentedOutbox::topicAt(const Segment& segment, qint64 offset) {
+    auto body = segment.data + offset + kRecordHeaderSize;
+    return QString::fromUtf8(reinterpret_cast<const char*>(body + 4), qFromLittleEndian<quint16>(body));
+}
+
+
+bool SegmentedOutbox::loadIndex() {
+    QFile f(mDir.filePath("index"));
+    if (!f.open(QIODevice::ReadOnly)) return false;
+
+    auto data = f.readAll();
+    auto bytes = reinterpret_cast<const uchar*>(data.constData());
+    if (data.size() < kIndexHeaderSize || memcmp(bytes, kIndexMagic, sizeof(kIndexMagic)) != 0 ||
+        qFromLittleEndian<quint16>(bytes + 4) != kIndexVersion) {
+        return false;
+    }
+    if (crc32(0, bytes + kIndexHeaderSize, uInt(data.size() - kIndexHeaderSize)) != qFromLittleEndian<quint32>(bytes + 12)) {
+        qWarning() << "Outbox index" << f.fileName() << "is damaged";
+        return false;
+    }
+
+    auto count = qFromLittleEndian<quint32>(bytes + 8);
+    qint64 offset = kIndexHeaderSize;
+    for (quint32 i = 0; i < count; i++) {
+        if (offset + 32 > data.size()) return false;
+        auto entry = bytes + offset;
+        auto number = qFromLittleEndian<quint64>(entry);
+        auto end = qint64(qFromLittleEndian<quint64>(entry + 8));
+        auto last = qint64(qFromLittleEndian<quint64>(entry + 16));
+        auto records = qint32(qFromLittleEndian<quint32>(entry + 24));
+        auto topicCount = qFromLittleEndian<quint32>(entry + 28);
+        offset += 32;
+
+        QHash<QString, qint32> topics;
+        for (quint32 t = 0; t < topicCount; t++) {
+            if (offset + 2 > data.size()) return false;
+            auto length = qFromLittleEndian<quint16>(bytes + offset);
+            if (offset + 2 + length + 4 > data.size()) return false;
+            auto topic = QString::fromUtf8(data.constData() + offset + 2, length);
+            topics[topic] = qint32(qFromLittleEndian<quint32>(bytes + offset + 2 + length));
+            offset += 2 + length + 4;
+        }
+
+        //the last record must still be there, otherwise the segment is scanned
+        auto current = segment(number);
+        if (!current || end > current->size) continue;
+        if (end > 0 && readRecord(*current, last, nullptr) != end) continue;
+
+        current->end = end;
+        current->last = end > 0 ? last : -1;
+        current->records = records;
+        current->topics = std::move(topics);
+    }
+    return true;
+}
+
+
+void SegmentedOutbox::saveIndex() {
+    QByteArray entries;
+    for (const auto& segment: mSegments) {
+        put<quint64>(entries, segment.number);
+        put<quint64>(entries, segment.end);
+        put<quint64>(entries, segment.last);
+        put<quint32>(entries, segment.records);
+        put<quint32>(entries, segment.topics.size());
+        for (auto it = segment.topics.constBegin(); it != segment.topics.constEnd(); ++it) {
+            auto topic = it.key().toUtf8();
+            put<quint16>(entries, topic.size());
+            entries += topic;
+            put<quint32>(entries, it.value());
+        }
+    }
+
+    QByteArray out;
+    out.reserve(kIndexHeaderSize + entries.size());
+    out.append(kIndexMagic, sizeof(kIndexMagic));
+    put<quint16>(out, kIndexVersion);
+    put<quint16>(out, 0);
+    put<quint32>(out, mSegments.size());
+    put<quint32>(out, crc32(0, reinterpret_cast<const uchar*>(entries.constData()), uInt(entries.size())));
+    out += entries;
+
+    QSaveFile f(mDir.filePath("index"));
+    if (!f.open(QIODevice::WriteOnly) || f.write(out) != out.size() || !f.commit()) {
+        qWarning() << "Failed to write" << f.fileName();
+    }
+    mIndexSaved.restart();
+}
+
+
+void SegmentedOutbox::recover() {
+    mRecoveredFromIndex = loadIndex();
+
+    //records appended after the index was saved, or every record without an index
+    for (auto& segment: mSegments) {
+        qint64 next;
+        while ((next = readRecord(segment, segment.end, nullptr)) >= 0) {
+            segment.topics[topicAt(segment, segment.end)]++;
+            segment.records++;
+            segment.last = segment.end;
+            segment.end = next;
+        }
+        mCount += segment.records;
+        for (auto it = segment.topics.constBegin(); it != segment.topics.constEnd(); ++it) {
+            mTopicCounts[it.key()] += it.value();
+        }
+    }
+
+    //records of the oldest segment before the confirmed position were sent already
+    if (auto first = segment(mConfirmed.segment)) {
+        if (mConfirmed.offset > first->end) {
+            qWarning() << "Outbox cursor is past the end of" << first->file->fileName();
+            mConfirmed.offset = first->end;
+        }
+        qint64 offset = 0;
+        while (offset < mConfirmed.offset) {
+            mTopicCounts[topicAt(*first, offset)]--;
+            mCount--;
+            offset += kRecordHeaderSize + qFromLittleEndian<quint32>(first->data + offset);
+        }
+    }
+    mTopicCounts.removeIf([](const auto& it) {return it.value() <= 0;});
+}
+
+
+void SegmentedOutbox::openCursor() {
+    mCursorFile.setFileName(mDir.filePath("cursor"));
+    if (!mCursorFile.open(QIODevice::ReadWrite) ||
+        (mCursorFile.size() < kCursorSize && !mCursorFile.resize(kCursorSize)) ||
+        !(mCursor = mCursorFile.map(0, kCursorSize))) {
+        qWarning() << "Failed to open" << mCursorFile.fileName();
+        return;
+    }
+
+    //the newer slot wins, a slot torn by a crash fails the checksum
+    for (qint64 i = 0; i < 2; i++) {
+        auto slot = mCursor + i * kCursorSlotSize;
+        if (crc32(0, slot, 24) != qFromLittleEndian<quint32>(slot + 24)) continue;
+
+        auto sequence = qFromLittleEndian<quint64>(slot);
+        if (sequence >= mCursorSequence) {
+            mCursorSequence = sequence;
+            mConfirmed = {qFromLittleEndian<quint64>(slot + 8), qint64(qFromLittleEndian<quint64>(slot + 16))};
+        }
+    }
+}
+
+
+void SegmentedOutbox::writeCursor() {
+    if (!mCursor) return;
+
+    auto slot = mCursor + (++mCursorSequence % 2) * kCursorSlotSize;
+    qToLittleEndian<quint64>(mCursorSequence, slot);
+    qToLittleEndian<quint64>(mConfirmed.segment, slot + 8);
+    qToLittleEndian<quint64>(mConfirmed.offset, slot + 16);
+    qToLittleEndian<quint32>(crc32(0, slot, 24), slot + 24);
+    qToLittleEndian<quint32>(0, slot + 28);
+    mCursorDirty = true;
+    scheduleSync();
+}
+
+
+void SegmentedOutbox::scheduleSync() {
+    if (mSyncMs <= 0) {
+        sync(true);
+    } else if (!mSyncTimer.isActive()) {
+        mSyncTimer.start(mSyncMs);
+    }
+}
+
+
+void SegmentedOutbox::sync(bool wait) {
+    mSyncTimer.stop();
+    if (mSyncing) {
+        //the records appended meanwhile are synced when the running sync is done
+        mSyncAgain = true;
+        return;
+    }
+
+    QList<int> files;
+    for (auto& segment: mSegments) {
+        if (segment.number < mSynced.segment) continue;
+
+        auto from = segment.number == mSynced.segment ? mSynced.offset : 0;
+        if (segment.end > from) {
+            flush(segment.data, from, segment.end);
+            files << duplicate(*segment.file);
+        }
+    }
+    if (mCursorDirty) {
+        flush(mCursor, 0, kCursorSize);
+        files << duplicate(mCursorFile);
+        mCursorDirty = false;
+    }
+    auto position = mSegments.empty() ? mSynced : Position{mSegments.back().number, mSegments.back().end};
+
+    if (wait || files.isEmpty()) {
+        syncFiles(files);
+        onSynced(position);
+        return;
+    }
+
+    //the wait for the disk runs on a worker thread, slow storage does not stall the event loop
+    mSyncing = true;
+    auto promise = std::make_shared<QPromise<void>>();
+    mSyncDone = promise->future();
+    QThreadPool::globalInstance()->start([promise, files] {
+        promise->start();
+        syncFiles(files);
+        promise->finish();
+    });
+    mSyncDone.then(&mSyncTimer, [this, position] {
+        mSyncing = false;
+        onSynced(position);
+        if (mSyncAgain) {
+            mSyncAgain = false;
+            scheduleSync();
+        }
+    });
+}
+
+
+void SegmentedOutbox::onSynced(Position position) {
+    mSynced = position;
+
+    //saved after the data it describes is on disk
+    if (mIndexSaved.elapsed() >= kIndexIntervalMs) {
+        saveIndex();
+    }
+}
+
+
+bool SegmentedOutbox::append(const QString& topic, const QString& key, QByteArray payload) {
+    if (mLimit > 0 && mCount >= mLimit) {
+        if (mDropped++ % 10000 == 0) {
+            qWarning() << "Outbox is full," << mDropped << "records dropped";
+        }
+        return false;
+    }
+
+    auto topicUtf8 = topic.toUtf8();
+    auto keyUtf8 = key.toUtf8();
+    if (topicUtf8.size() > 0xffff || keyUtf8.size() > 0xffff) {
+        qWarning() << "Outbox record dropped, topic or key is too long";
+        mDropped++;
+        return false;
+    }
+
+    auto length = 4 + topicUtf8.size() + keyUtf8.size() + payload.size();
+    auto segment = mSegments.empty() ? nullptr : &mSegments.back();
+    if (segment && !segment->reserved) {
+        //a segment found on startup may be sparse
+        segment->reserved = reserve(*segment->file, segment->size);
+    }
+    if (!segment || !segment->reserved || segment->end + kRecordHeaderSize + length > segment->size) {
+        segment = addSegment(kRecordHeaderSize + length);
+        if (!segment) {
+            mDropped++;
+            return false;
+        }
+    }
+
+    auto record = segment->data + segment->end;
+    auto body = record + kRecordHeaderSize;
+    qToLittleEndian<quint16>(topicUtf8.size(), body);
+    qToLittleEndian<quint16>(keyUtf8.size(), body + 2);
+    auto text = body + 4;
+    memcpy(text, topicUtf8.constData(), topicUtf8.size());
+    memcpy(text + topicUtf8.size(), keyUtf8.constData(), keyUtf8.size());
+    memcpy(text + topicUtf8.size() + keyUtf8.size(), payload.constData(), payload.size());
+    qToLittleEndian<quint32>(length, record);
+    qToLittleEndian<quint32>(checksum(segment->number, body, length), record + 4);
+
+    segment->last = segment->end;
+    segment->end += kRecordHeaderSize + length;
+    segment->records++;
+    segment->topics[topic]++;
+    mTopicCounts[topic]++;
+    mCount++;
+    scheduleSync();
+    return true;
+}
+
+
+void SegmentedOutbox::truncate(Segment& segment, qint64 end) {
+    //the counters are rebuilt from the records before end, the ones after it are dropped
+    QHash<QString, qint32> topics;
+    qint32 records = 0;
+    qint64 offset = 0;
+    qint64 last = -1;
+    qint64 next;
+    while (offset < end && (next = readRecord(segment, offset, nullptr)) >= 0) {
+        topics[topicAt(segment, offset)]++;
+        records++;
+        last = offset;
+        offset = next;
+    }
+
+    auto lost = segment.records - records;
+    mCount -= lost;
+    mDropped += lost;
+    for (auto it = segment.topics.constBegin(); it != segment.topics.constEnd(); ++it) {
+        auto count = mTopicCounts.find(it.key());
+        if (count != mTopicCounts.end() && (*count -= it.value() - topics.value(it.key())) <= 0) {
+            mTopicCounts.erase(count);
+        }
+    }
+    segment.end = offset;
+    segment.last = last;
+    segment.records = records;
+    segment.topics = std::move(topics);
+}
+
+
+QList<Outbox::Item> SegmentedOutbox::next() {
+    QList<Item> items;
+    QHash<QString, qint32> topics;
+    while (items.size() < mGroupRecords) {
+        auto current = segment(mRead.segment);
+        if (!current) break;
+        if (mRead.offset >= current->end) {
+            if (current == &mSegments.back()) break;
+            mRead = {mRead.segment + 1, 0};
+            continue;
+        }
+
+        Item item;
+        auto next = readRecord(*current, mRead.offset, &item);
+        if (next < 0) {
+            qWarning() << "Corrupted record in" << current->file->fileName() << "at" << mRead.offset
+                       << "dropped with the rest of the segment";
+            truncate(*current, mRead.offset);
+            continue;
+        }
+        topics[item.topic]++;
+        items << std::move(item);
+        mRead.offset = next;
+    }
+
+    if (!items.isEmpty()) {
+        mPulled.enqueue({mRead, qint32(items.size()), std::move(topics)});
+    }
+    return items;
+}
+
+
+void SegmentedOutbox::confirm() {
+    if (mPulled.isEmpty()) return;
+
+    auto group = mPulled.dequeue();
+    mCount -= group.records;
+    mConfirmed = group.end;
+    for (auto it = group.topics.constBegin(); it != group.topics.constEnd(); ++it) {
+        auto count = mTopicCounts.find(it.key());
+        if (count != mTopicCounts.end() && (*count -= it.value()) <= 0) {
+            mTopicCounts.erase(count);
+        }
+    }
+
+    //a fully confirmed segment is released as soon as the next one exists
+    auto current = segment(mConfirmed.segment);
+    if (current && mConfirmed.offset >= current->end && current != &mSegments.back()) {
+        mConfirmed = {mConfirmed.segment + 1, 0};
+    }
+    writeCursor();
+    recycle();
+}
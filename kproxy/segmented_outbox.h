@@ -0,0 +1,103 @@
+#pragma once
+#include "outbox.h"
+#include <deque>
+
+//Append-only outbox in memory mapped segment files of segmentBytes each. Layout, little endian:
+//  segment  <dir>/<segment number, 16 hex digits>.seg
+//  record   u32 body length, u32 crc32 of the segment number and the body, then the body:
+//           u16 topic length, u16 key length, utf8 topic and key, payload
+//  cursor   <dir>/cursor, two 32 byte slots written in turn: u64 sequence, u64 segment,
+//           u64 offset, u32 crc32 of the first 24 bytes, u32 reserved
+//  index    <dir>/index, "KOBX", u16 format version, u16 flags, u32 segment count, u32 crc32
+//           of the entries. Per segment: u64 number, u64 end, u64 offset of the last record,
+//           u32 records, u32 topic count, then per topic u16 length, utf8 topic, u32 records
+//Segment files are allocated with posix_fallocate before they are written, a segment which
+//can not be allocated is not created and its records are dropped. The first record with a
+//wrong checksum ends a segment, so a torn write is dropped and a recycled segment file does
+//not have to be cleared. A record found damaged by next() truncates its segment there. Appends are synced to disk in groups
+//every syncMs, a confirm only writes the confirmed position into the mapped cursor file.
+//The index is saved after a sync at most once a second. On startup only the records written
+//after the last index and the confirmed part of the oldest segment are read
+class SegmentedOutbox : public Outbox {
+    struct Segment {
+        quint64 number;
+        std::unique_ptr<QFile> file;
+        uchar* data {nullptr};
+        qint64 size {0};
+        qint64 end {0};    //first byte after the last record
+        qint64 last {-1};  //offset of the last record
+        qint32 records {0};
+        QHash<QString, qint32> topics;
+        bool reserved {false}; //disk blocks allocated, safe to write through the mapping
+    };
+
+    struct Position {
+        quint64 segment;
+        qint64 offset;
+    };
+
+    struct PulledGroup {
+        Position end;
+        qint32 records;
+        QHash<QString, qint32> topics;
+    };
+
+    QDir mDir;
+    qint64 mSegmentBytes;
+    qint32 mLimit;
+    qint32 mGroupRecords;
+    std::deque<Segment> mSegments;    //oldest segment with unconfirmed records first
+    Position mConfirmed {0, 0};
+    Position mRead {0, 0};
+    qint32 mCount {0};
+    QQueue<PulledGroup> mPulled;
+    quint64 mDropped {0};
+    QHash<QString, qint32> mTopicCounts; //records not confirmed yet by topic
+
+    QFile mCursorFile;
+    uchar* mCursor {nullptr};
+    quint64 mCursorSequence {0};
+
+    //group commit. Everything after mSynced is written to disk by the next sync(), which
+    //waits for the disk on a worker thread unless syncMs is 0
+    QTimer mSyncTimer;
+    qint32 mSyncMs;
+    Position mSynced {0, 0};
+    bool mCursorDirty {false};
+    bool mSyncing {false};
+    bool mSyncAgain {false};
+    QFuture<void> mSyncDone;
+    QElapsedTimer mIndexSaved;
+
+    qint64 mRecoveryMs {0};
+    bool mRecoveredFromIndex {false};
+
+    QString segmentName(quint64 number) const;
+    Segment* segment(quint64 number);
+    bool mapSegment(Segment& segment, qint64 size);
+    Segment* addSegment(qint64 minSize);
+    void recycle();
+    qint64 readRecord(const Segment& segment, qint64 offset, Item* item) const;
+    void truncate(Segment& segment, qint64 end);
+    static QString topicAt(const Segment& segment, qint64 offset);
+    bool loadIndex();
+    void saveIndex();
+    void recover();
+    void openCursor();
+    void writeCursor();
+    void scheduleSync();
+    void sync(bool wait);
+    void onSynced(Position position);
+public:
+    SegmentedOutbox(const QString& dir, qint32 limit, qint64 segmentBytes, qint32 syncMs, qint32 groupRecords = 500);
+    ~SegmentedOutbox() override;
+
+    bool append(const QString& topic, const QString& key, QByteArray payload) override;
+    qint32 size() const override {return mCount;}
+    QList<Item> next() override;
+    void confirm() override;
+    quint64 dropped() const {return mDropped;}
+    QHash<QString, qint32> topicCounts() const {return mTopicCounts;}
+    qint64 recoveryMs() const {return mRecoveryMs;}
+    bool recoveredFromIndex() const {return mRecoveredFromIndex;}
+};
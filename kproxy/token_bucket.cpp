@@ -0,0 +1,33 @@
+#include "token_bucket.h"
+#include <cmath>
+
+TokenBucket::TokenBucket(double ratePerSecond, double burst) :
+    mRate{qMax(0.0, ratePerSecond)}, mBurst{burst > 0 ? burst : mRate}, mTokens{mBurst}
+{
+}
+
+
+void TokenBucket::refill(qint64 nowMs) {
+    if (mUpdated >= 0 && nowMs > mUpdated) {
+        mTokens = qMin(mBurst, mTokens + (nowMs - mUpdated) * mRate / 1000);
+    }
+    mUpdated = nowMs;
+}
+
+
+qint64 TokenBucket::waitMs(qint64 count, qint64 nowMs) {
+    if (!enabled()) return 0;
+
+    refill(nowMs);
+    auto needed = qMin(double(count), mBurst);
+    if (mTokens >= needed) return 0;
+    return qint64(std::ceil((needed - mTokens) * 1000 / mRate));
+}
+
+
+void TokenBucket::take(qint64 count, qint64 nowMs) {
+    if (!enabled()) return;
+
+    refill(nowMs);
+    mTokens -= count;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <QtCore>
+
+//Refills ratePerSecond tokens a second up to burst. A request larger than the burst is let
+//through once the bucket is full and leaves it in debt, so large batches are not stuck.
+//A rate of 0 disables the bucket
+class TokenBucket {
+    double mRate;
+    double mBurst;
+    double mTokens;
+    qint64 mUpdated {-1};
+
+    void refill(qint64 nowMs);
+public:
+    TokenBucket(double ratePerSecond = 0, double burst = 0);
+
+    bool enabled() const {return mRate > 0;}
+    //ms until count tokens can be taken, 0 when they are available now
+    qint64 waitMs(qint64 count, qint64 nowMs);
+    void take(qint64 count, qint64 nowMs);
+};
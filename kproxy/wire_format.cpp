@@ -0,0 +1,26 @@
+#include "wire_format.h"
+#include "base64.h"
+
+void WireFormat::writeHeader(char* out, qint32 schemaId) {
+    out[0] = 0x00; //magic
+    qToBigEndian<qint32>(schemaId, out + 1);
+    out[5] = 0x00; //the first message in the proto file
+}
+
+
+void WireFormat::appendBase64(QByteArray& out, qint32 schemaId, QByteArrayView payload) {
+    bool framed = schemaId != -1;
+    auto start = out.size();
+    out.resize(start + (framed ? Base64::encodedSize(kHeaderSize) : 0) + Base64::encodedSize(payload.size()));
+
+    auto dst = out.data() + start;
+    if (framed) {
+        //6 bytes encode to exactly 8 characters without padding, so the
+        //payload can be encoded on its own right after the header
+        char header[kHeaderSize];
+        writeHeader(header, schemaId);
+        Base64::encode(header, kHeaderSize, dst);
+        dst += Base64::encodedSize(kHeaderSize);
+    }
+    Base64::encode(payload.data(), payload.size(), dst);
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <QtCore>
+
+//Confluent wire format: magic byte 0, big endian schema id, message index 0, then the protobuf payload
+class WireFormat {
+public:
+    static constexpr qsizetype kHeaderSize = 6;
+
+    static void writeHeader(char* out, qint32 schemaId);
+    //appends base64(header + payload) to out, growing it only once.
+    //The header is skipped when schemaId is -1
+    static void appendBase64(QByteArray& out, qint32 schemaId, QByteArrayView payload);
+};
@@ -87,8 +87,8 @@ void showLagSummary(KafkaProxyV3& v3, const QString& groupName) {
 
 
 void v2Commands(KafkaProxyV2& v2, QCommandLineParser& parser) {
-    auto offset = parser.value("set-offset").toInt();
-    v2.commitOffset(parser.value("topic"), offset);
+    auto offset = parser.value("set-offset").toLongLong();
+    v2.commitOffset(parser.value("topic"), offset, parser.value("partition").toInt());
     QObject::connect(&v2, &KafkaProxyV2::offsetCommitted, [offset]{
         qDebug().noquote() << "Reading position set to" << offset;
         QCoreApplication::quit();
@@ -157,7 +157,8 @@ int main(int argc, char** argv) {
             {"lag-summary", "Get lat summary"},
             {"set-offset", "Set reading offset", "set-offset"},
             {"verbose", "verbose logging"},
-            {"topic", "change the offset of topic", "topic"}
+            {"topic", "change the offset of topic", "topic"},
+            {"partition", "partition of the topic, 0 by default", "partition", "0"}
             
     });
 
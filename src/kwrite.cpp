@@ -69,7 +69,7 @@ bool sendProtobuf(const QString& key, const QString& topic, const QString& base6
         QCoreApplication::quit();
     });
 
-    producer->send({key, topic, value});
+    producer->send(OutputBinaryMessage{key, topic, value});
     return true;
 }
 